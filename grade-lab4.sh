@@ -7,14 +7,13 @@ qemuopts="-hda obj/kern/kernel.img"
 $make
 
 timeout=10
-E0='07'
-E1='08'
-E2='09'
-E3='0a'
-E4='0b'
-E5='0c'
-E6='0d'
-E7='0e'
+E1='00'
+E2='01'
+E3='02'
+E4='03'
+E5='04'
+E6='05'
+E7='06'
 
 runtest1 dumbfork \
 	".00000000. new env 00001000" \
@@ -71,15 +70,15 @@ runtest1 faultallocbad \
 	".000010$E1. free env 000010$E1" 
 
 runtest1 faultnostack \
-	".000010$E1. user_mem_check assertion failure for va eebfff.." \
+	".000010$E1. user_mem_check assertion failure for va ee3fff.." \
 	".000010$E1. free env 000010$E1"
 
 runtest1 faultbadhandler \
-	".000010$E1. user_mem_check assertion failure for va (deadb|eebfe)..." \
+	".000010$E1. user_mem_check assertion failure for va (deadb|ee3fe)..." \
 	".000010$E1. free env 000010$E1"
 
 runtest1 faultevilhandler \
-	".000010$E1. user_mem_check assertion failure for va (f0100|eebfe)..." \
+	".000010$E1. user_mem_check assertion failure for va (f0100|ee3fe)..." \
 	".000010$E1. free env 000010$E1"
 
 runtest1 forktree \
@@ -116,7 +115,41 @@ qemuopts="$qemuopts -smp 2"
 runtest1 stresssched \
 	".000010... stresssched on CPU 0" \
 	".000010... stresssched on CPU 1" \
-	! ".*ran on two CPUs at once"
+	! ".*ran on two CPUs at once" \
+	! ".*outside its affinity mask"
+
+runtest1 fpu \
+	".000010$E1. FPU state preserved" \
+	".000010$E2. FPU state preserved" \
+	! ".*FPU state lost"
+
+runtest1 unmaprange \
+	"unmaprange OK" \
+	! ".*panic"
+
+runtest1 demandzero \
+	"demandzero OK" \
+	! ".*panic"
+
+runtest1 psum \
+	"psum OK" \
+	! ".*panic"
+
+runtest1 uthreads \
+	"uthreads OK" \
+	! ".*panic"
+
+runtest1 uthreadpreempt \
+	"uthreadpreempt OK" \
+	! ".*panic"
+
+runtest1 edf \
+	"edf OK" \
+	! ".*panic"
+
+runtest1 prio \
+	"prio OK" \
+	! ".*panic"
 
 runtest1 pingpong \
 	".00000000. new env 00001000" \
@@ -143,7 +176,7 @@ runtest1 primes \
 	"CPU .: 5 .000010$E4. new env 000010$E5" \
 	"CPU .: 7 .000010$E5. new env 000010$E6" \
 	"CPU .: 11 .000010$E6. new env 000010$E7" \
-	"CPU .: 1877 .00001128. new env 00001129"
+	"CPU .: 1877 .00001120. new env 00001121"
 
 showpart C
 
@@ -11,23 +11,30 @@ typedef int32_t envid_t;
 
 // An environment ID 'envid_t' has three parts:
 //
-// +1+---------------21-----------------+--------10--------+
-// |0|          Uniqueifier             |   Environment    |
-// | |                                  |      Index       |
-// +------------------------------------+------------------+
-//                                       \--- ENVX(eid) --/
+// +1+--3--+-------------16-------------+----------12----------+
+// |0|Index|         Uniqueifier         |  Environment Index   |
+// | | high|                             |         low          |
+// +-+-----+-----------------------------+----------------------+
 //
-// The environment index ENVX(eid) equals the environment's offset in the
-// 'envs[]' array.  The uniqueifier distinguishes environments that were
-// created at different times, but share the same environment index.
+// The environment index ENVX(eid), put together from its two parts,
+// equals the environment's offset in the 'envs[]' array.  The
+// uniqueifier distinguishes environments that were created at different
+// times, but share the same environment index.  With the low part at
+// the bottom, the first 4096 environments get the IDs they always had.
+//
+// NENV only bounds the index.  The kernel sizes envs[] at boot from the
+// memory it has, and maps just that many at UENVS.
 //
 // All real environments are greater than 0 (so the sign bit is zero).
 // envid_ts less than 0 signify errors.  The envid_t == 0 is special, and
 // stands for the current environment.
 
-#define LOG2NENV		10
+#define LOG2NENV		15
 #define NENV			(1 << LOG2NENV)
-#define ENVX(envid)		((envid) & (NENV - 1))
+#define ENVX(envid)		(((envid) & 0xFFF) | (((envid) >> 16) & 0x7000))
+
+// env_cpumask value for an environment that may run on any CPU
+#define ENV_CPUMASK_ALL		0xFFFFFFFF
 //#define GETENV(_envid)          ((_envid) ? (&(envs[ENVX(_envid)])): (curenv)) 
 
 // Values of env_status in struct Env
@@ -36,38 +43,103 @@ enum {
 	ENV_DYING,
 	ENV_RUNNABLE,
 	ENV_RUNNING,
-	ENV_NOT_RUNNABLE
+	ENV_NOT_RUNNABLE,
+	ENV_RECLAIM		// Dead; address space still being torn down
 };
 
 // Special environment types
 enum EnvType
 {
     ENV_TYPE_USER = 0,
-    ENV_TYPE_IDLE,
 };
 
+// A range of user memory whose pages are allocated, already zeroed,
+// the first time they are touched.
+struct EnvRegion {
+	uintptr_t er_start;		// Page aligned; er_start == er_end
+	uintptr_t er_end;		// marks an unused slot
+	int er_perm;			// Permissions of the pages mapped
+	envid_t er_group;		// Envs sharing its pages, 0 if private
+};
+
+#define ENV_NREGIONS		8
+
+// Scheduler activation events, passed to env_sa_upcall in utf_err
+#define SA_PREEMPTED		0x1	// The timer took the CPU away
+#define SA_UNBLOCKED		0x2	// A message ended sys_ipc_recv
+
+// struct Env is split in two.  The fields that walking the run queue
+// and delivering a message read come first and fill exactly one cache
+// line, and every Env starts on a line of its own, so a walk reads one
+// line per environment.  The cold rest (trapframe, address space,
+// accounting, upcalls) is touched only when the environment runs or
+// traps.  A scan over all environments reads neither: the kernel keeps
+// status, affinity, last CPU and run count packed four envs to a line
+// in a separate array (env_sched, see kern/env.h).  User code reads
+// everything here through UENVS by field name as before.
+#define ENV_HOT_BYTES		64
+
 struct Env {
-	struct Trapframe env_tf;	// Saved registers
-	struct Env *env_link;		// Next free Env
+	// Hot: scheduling
 	envid_t env_id;			// Unique environment identifier
-	envid_t env_parent_id;		// env_id of this env's parent
-	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
-	uint32_t env_runs;		// Number of times environment has run
+	int env_prio;			// Run queue level, 0 = highest
+	bool env_rq_queued;		// On the run queue, see kern/sched.c
+	struct Env *env_rq_next;	// Run queue links
+	struct Env *env_rq_prev;
+	uint32_t env_cpumask;		// CPUs it may run on (bit i = CPU i)
 	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_runs;		// Number of times environment has run
+	int env_gang;			// Gang it is co-scheduled with, 0 = none
+	uint32_t env_rt_period;		// EDF period in microseconds, 0 = best effort
+
+	// Hot: Lab 4 IPC
+	bool env_ipc_recving;		// Env is receiving
+	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_value;		// Data value sent to us
+	envid_t env_ipc_from;		// envid of the sender
+	int env_ipc_perm;		// Perm of page mapping received
+
+	// Cold, from the next cache line on
+	struct Trapframe env_tf __attribute__((aligned(ENV_HOT_BYTES)));
+					// Saved registers
+	struct Env *env_link;		// Next free Env
+	volatile uint32_t env_ref;	// Lookups holding it, see envid2env
+	envid_t env_parent_id;		// env_id of this env's parent
+	enum EnvType env_type;		// Indicates special system environments
+	uint32_t env_quantum;		// Timeslice in microseconds, 0 = default
+	bool env_ipc_nowait;		// Receiving without blocking, see
+					// sys_ipc_try_recv
+
+	// Rest of the earliest-deadline-first reservation, see kern/sched.c
+	uint32_t env_rt_budget;		// CPU time per period, in microseconds
+	int env_rt_cpu;			// CPU it was admitted on
+	uint64_t env_rt_deadline;	// End of the current period, in time_ns
+	uint64_t env_rt_used;		// Nanoseconds of budget used this period
+	bool env_rt_done;		// Gave up the CPU: job done this period
+	uint32_t env_rt_misses;		// Periods that ended with the job unfinished
+	struct Env *env_rt_next;	// Next on its CPU's cpu_rt_list
+
+	// CPU time accounting, in TSC cycles
+	uint64_t env_utime;		// Cycles spent in user mode
+	uint64_t env_ktime;		// Cycles the kernel spent on its behalf
+	uint32_t env_vswitches;		// Times it gave up the CPU itself
+	uint32_t env_ivswitches;	// Times the timer took the CPU away
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	struct EnvRegion *env_regions;	// ENV_NREGIONS demand-zero ranges
+	struct Env *env_share_next;	// Ring of envs that may share regions
+	struct Env *env_share_prev;
+
+	// FPU/SSE state, see kern/fpu.c
+	struct FpuState *env_fpu;	// Save area, allocated on first use
+	int env_fpu_cpu;		// CPU whose FPU holds its state, or -1
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
-
-	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
-	void *env_ipc_dstva;		// VA at which to map received page
-	uint32_t env_ipc_value;		// Data value sent to us
-	envid_t env_ipc_from;		// envid of the sender
-	int env_ipc_perm;		// Perm of page mapping received
-};
+	void *env_sa_upcall;		// Scheduler activation entry point
+	uint32_t env_sa_pending;	// SA_* events not yet delivered
+} __attribute__((aligned(ENV_HOT_BYTES)));
 
 #endif // !JOS_INC_ENV_H
@@ -25,7 +25,11 @@ void umain (int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+// Our Env.  It lives in the top word of our own stack (see entry.S),
+// which sfork does not share, so each thread has its own.
+#define thisenv	(*(const volatile struct Env **) (USTACKTOP - 4))
+// Our malloc cache slot, in the word below it and just as private.
+#define thisslot	(*(volatile int *) (USTACKTOP - 8))
 extern const volatile struct Env envs[NENV];
 extern const volatile struct Page pages[];
 
@@ -44,6 +48,7 @@ int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
+int	sys_yield_to(envid_t env);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
@@ -51,8 +56,20 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_unmap_range(envid_t env, void *va, size_t len);
+int	sys_region_reserve(envid_t env, void *va, size_t len, int perm);
+int	sys_region_share(envid_t env);
+int	sys_env_set_sa_upcall(envid_t env, void *upcall);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_recv(void *rcv_pg);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
+int	sys_env_set_quantum(envid_t env, uint32_t us);
+int	sys_env_set_priority(envid_t env, int prio);
+int	sys_env_set_rt(envid_t env, uint32_t period, uint32_t budget);
+int	sys_gang_create(void);
+int	sys_gang_join(envid_t env, int gang);
+uint64_t sys_time_ns(void);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -72,6 +89,24 @@ void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
+// malloc.c
+int	malloc_init(void);
+void	*malloc(size_t size);
+void	free(void *v);
+void	*calloc(size_t nmemb, size_t size);
+void	*realloc(void *v, size_t size);
+
+// uthread.c
+#define UTHREAD_MAX		64
+#define UTHREAD_STACKPAGES	4
+int	uthread_create(void (*fn)(void *), void *arg);
+int	uthread_yield(void);
+void	uthread_exit(void) __attribute__((noreturn));
+int	uthread_self(void);
+bool	uthread_active(void);
+int	uthread_preempt(void);
+int32_t	uthread_ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
@@ -53,14 +53,14 @@
  *    UVPT/vpt  ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ *                     |           RO ENVS            | R-/R-  UENVSIZE
+ * UTOP,UENVS ------>  +------------------------------+ 0xee400000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee3ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee3fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee3fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -115,15 +115,17 @@
 /*
  *Hawx: UVPT is     0xEF400000
  *      UPAGES is   0xEF000000
- *      UENVS  is   0xEEC00000, UTOP, UXSTACKTOP, too.
+ *      UENVS  is   0xEE400000, UTOP, UXSTACKTOP, too.
  */
 #define UVPT		(ULIM - PTSIZE)
 
 // Read-only copies of the Page structures
 #define UPAGES		(UVPT - PTSIZE)
 
-// Read-only copies of the global env structures
-#define UENVS		(UPAGES - PTSIZE)
+// Read-only copies of the global env structures.  Room for NENV of them,
+// though only those the kernel allocated at boot are mapped.
+#define UENVSIZE	(3 * PTSIZE)
+#define UENVS		(UPAGES - UENVSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -143,6 +145,13 @@
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
 
+// User heap managed by lib/malloc.c
+#define UHEAP		0x40000000
+#define UHEAPSIZE	0x20000000
+
+// Stacks of user-level threads, see lib/uthread.c
+#define UTSTACKS	(UHEAP + UHEAPSIZE)
+
 // Used for temporary page mappings.  Typed 'void*' for convenience
 #define UTEMP		((void*) PTSIZE)
 
@@ -23,4 +23,10 @@ void *memfind (const void *s, int c, size_t len);
 
 long strtol (const char *s, char **endptr, int base);
 
+// Fills and copies of whole 64-byte blocks that bypass the cache; use
+// them only where use_nt says so.  See lib/string.c.
+bool use_nt (const void *dst, size_t n);
+void nt_fill64 (void *v, uint32_t c, size_t blocks);
+void nt_copy64 (void *d, const void *s, size_t blocks);
+
 #endif /* not JOS_INC_STRING_H */
@@ -16,6 +16,19 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_env_set_affinity,
+	SYS_env_set_quantum,
+	SYS_time_ns,
+	SYS_page_unmap_range,
+	SYS_region_reserve,
+	SYS_region_share,
+	SYS_env_set_sa_upcall,
+	SYS_yield_to,
+	SYS_gang_create,
+	SYS_gang_join,
+	SYS_env_set_rt,
+	SYS_env_set_priority,
+	SYS_ipc_try_recv,
 	NSYSCALLS
 };
 
@@ -27,6 +27,9 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL   48          // system call
+#define T_IPI_WAKEUP 240        // wake a CPU halted in sched_halt
+#define T_IPI_GANG  241         // start a gang's timeslice, see sched.c
+#define T_IPI_RESCHED 242       // EDF env woke up, see sched_rt_preempt
 #define T_DEFAULT   500         // catchall
 
 #define IRQ_OFFSET	32          // IRQ 0 corresponds to int IRQ_OFFSET
@@ -47,6 +47,10 @@ static __inline uint32_t read_esp (void) __attribute__ ((always_inline));
 static __inline void cpuid (uint32_t info, uint32_t * eaxp, uint32_t * ebxp,
                             uint32_t * ecxp, uint32_t * edxp);
 static __inline uint64_t read_tsc (void) __attribute__ ((always_inline));
+static __inline void wrmsr (uint32_t msr, uint64_t val)
+    __attribute__ ((always_inline));
+static __inline uint64_t rdpmc (uint32_t counter)
+    __attribute__ ((always_inline));
 
 static __inline void
 breakpoint (void)
@@ -284,6 +288,20 @@ read_tsc (void)
     return tsc;
 }
 
+static __inline void
+wrmsr (uint32_t msr, uint64_t val)
+{
+    __asm __volatile ("wrmsr"::"c" (msr), "A" (val));
+}
+
+static __inline uint64_t
+rdpmc (uint32_t counter)
+{
+    uint64_t val;
+    __asm __volatile ("rdpmc":"=A" (val):"c" (counter));
+    return val;
+}
+
 static inline uint32_t
 xchg (volatile uint32_t * addr, uint32_t newval)
 {
@@ -295,4 +313,25 @@ xchg (volatile uint32_t * addr, uint32_t newval)
     return result;
 }
 
+// Atomically add delta to *addr.  Returns the old value.
+static inline uint32_t
+xadd (volatile uint32_t * addr, uint32_t delta)
+{
+    asm volatile ("lock; xaddl %0, %1":"+r" (delta), "+m" (*addr)::"memory",
+                  "cc");
+    return delta;
+}
+
+// Load *addr before any later load or store.  x86 does not reorder a
+// load with later memory accesses, so only the compiler must be kept
+// from doing so.
+static inline uint32_t
+load_acquire (volatile uint32_t * addr)
+{
+    uint32_t v = *addr;
+
+    asm volatile ("":::"memory");
+    return v;
+}
+
 #endif /* !JOS_INC_X86_H */
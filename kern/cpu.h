@@ -10,10 +10,14 @@
 // Maximum number of CPUs
 #define NCPU  8
 
+// Environments one system call may look up with envid2env
+#define CPU_NENVREFS  4
+
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
 	CPU_STARTED,
+	CPU_HALTED,                     // Idle in sched_halt, lock released
 };
 
 // Per-CPU state
@@ -22,6 +26,20 @@ struct Cpu {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	uint64_t cpu_tsc_mark;          // TSC at the last user/kernel crossing
+	pde_t *cpu_pgdir;               // Page directory loaded in CR3
+	bool cpu_tlb_stale;             // cpu_pgdir changed by another CPU
+	struct Env *cpu_fpu_owner;      // Env whose state is in the FPU
+	bool cpu_fpu_dirty;             // ... and which used it this timeslice
+	struct Env *cpu_gang_next;      // Gang member to switch to, see sched.c
+	uint32_t cpu_rt_util;           // EDF utilization admitted here
+	struct Env *cpu_rt_list;        // EDF envs admitted here
+	uint64_t cpu_rt_next;           // Next EDF release, in time_ns, or 0
+	struct Env *cpu_rt_env;         // EDF env charged for this slice
+	uint64_t cpu_rt_start;          // ... since this time_ns
+	struct Env *cpu_env_refs[CPU_NENVREFS]; // Envs envid2env holds
+	int cpu_nenv_refs;              // ... for the current system call
+	volatile uint32_t cpu_epoch;    // Epoch announced, see kern/epoch.c
 };
 
 // Initialized in mpconfig.c
@@ -41,5 +59,8 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_arm(uint32_t us);
+void lapic_timer_stop(void);
 
 #endif
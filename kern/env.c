@@ -14,13 +14,24 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/epoch.h>
+#include <kern/slab.h>
 
 //struct Env *curenv = NULL;      // The current env
 struct Env *envs = NULL;		// All environments
+uint32_t nenv;				// Size of envs[], set by mem_init
+struct EnvSched *env_sched;		// Scan copy of envs[], see kern/env.h
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct Env *env_reclaim_list;	// ENV_RECLAIM envs, oldest first
+static struct Env **env_reclaim_tail = &env_reclaim_list;
+static struct SlabCache *env_region_cache;	// Region tables
 
-#define ENVGENSHIFT	12          // >= LOGNENV
+#define ENVGENSHIFT	12          // Uniqueifier bits, see inc/env.h
+#define ENVGENMASK	0x0FFFF000
+// The envid bits for envs[x]: the inverse of ENVX.
+#define ENVID_INDEX(x)	(((x) & 0xFFF) | (((x) & 0x7000) << 16))
 
 // Global descriptor table.
 //
@@ -64,11 +75,57 @@ struct Pseudodesc gdt_pd = {
     sizeof (gdt) - 1, (unsigned long) gdt
 };
 
+// Is e the live environment envid?
+static bool
+env_live (struct Env *e, envid_t envid)
+{
+    uint32_t status;
+
+    if (load_acquire ((volatile uint32_t *) &e->env_id) != envid)
+        return 0;
+    status = load_acquire (&e->env_status);
+    return status != ENV_FREE && status != ENV_RECLAIM;
+}
+
+// Hold a reference on e for the current system call.
+static void
+env_take_ref (struct Env *e)
+{
+    if (thiscpu->cpu_nenv_refs == CPU_NENVREFS)
+        panic ("envid2env: too many lookups in one system call");
+    xadd (&e->env_ref, 1);
+    thiscpu->cpu_env_refs[thiscpu->cpu_nenv_refs++] = e;
+}
+
+// Drop the reference taken last.
+static void
+env_drop_ref (void)
+{
+    struct Env *e = thiscpu->cpu_env_refs[--thiscpu->cpu_nenv_refs];
+
+    xadd (&e->env_ref, -1);
+}
+
+// Drop every reference this CPU's lookups hold.  Called on the way out
+// of the kernel, when the system call that made them is over.
+void
+env_drop_refs (void)
+{
+    while (thiscpu->cpu_nenv_refs > 0)
+        env_drop_ref ();
+}
+
 //
 // Converts an envid to an env pointer.
 // If checkperm is set, the specified environment must be either the
 // current environment or an immediate child of the current environment.
 //
+// The lookup takes no lock.  It takes a reference on the Env, which
+// keeps env_reclaim from tearing it down or handing the slot to a new
+// environment until this CPU next leaves the kernel (env_drop_refs).
+// The caller may use the Env for the rest of the system call even if
+// another CPU frees it meanwhile.
+//
 // RETURNS
 //   0 on success, -E_BAD_ENV on error.
 //   On success, sets *env_store to the environment.
@@ -79,11 +136,14 @@ envid2env (envid_t envid, struct Env **env_store, bool checkperm)
 {
     struct Env *e;
 
+    *env_store = NULL;
     if(envid < 0)
         return -E_BAD_ENV;
     // If envid is zero, return the current environment.
     if (envid == 0)
     {
+        if (curenv)
+            env_take_ref (curenv);
         *env_store = curenv;
         return 0;
     }
@@ -93,12 +153,20 @@ envid2env (envid_t envid, struct Env **env_store, bool checkperm)
     // to ensure that the envid is not stale
     // (i.e., does not refer to a _previous_ environment
     // that used the same slot in the envs[] array).
+    if (ENVX (envid) >= nenv)
+        return -E_BAD_ENV;
     e = &envs[ENVX (envid)];
-    if (e->env_status == ENV_FREE || e->env_id != envid)
+    if (!env_live (e, envid))
+        goto stale;
+    // Take the reference, then check again: the slot may have been
+    // freed, or even reused, since the first look.  env_reclaim sets
+    // the status before it reads env_ref, and we bump env_ref before
+    // we read the status, so one of us sees the other.
+    env_take_ref (e);
+    if (!env_live (e, envid))
     {
-        cprintf("!!! envid2env's Not Match: e->env_id:0x%08x/envid:0x%08x !!!\n",e->env_id,envid);
-        *env_store = 0;
-        return -E_BAD_ENV;
+        env_drop_ref ();
+        goto stale;
     }
 
     // Check that the calling environment has legitimate permission
@@ -109,12 +177,23 @@ envid2env (envid_t envid, struct Env **env_store, bool checkperm)
     if (checkperm && e != curenv && e->env_parent_id != curenv->env_id)
     {
         cprintf("!!! envid2env's Error in checkperm !!!\n");
-        *env_store = 0;
+        env_drop_ref ();
         return -E_BAD_ENV;
     }
 
     *env_store = e;
     return 0;
+
+stale:
+    cprintf("!!! envid2env's Not Match: e->env_id:0x%08x/envid:0x%08x !!!\n",e->env_id,envid);
+    return -E_BAD_ENV;
+}
+
+// A region table with every slot unused.
+static void
+env_region_ctor (void *obj)
+{
+    memset (obj, 0, ENV_NREGIONS * sizeof (struct EnvRegion));
 }
 
 // Mark all environments in 'envs' as free, set their env_ids to 0,
@@ -129,15 +208,23 @@ env_init (void)
     // Set up envs array
     // LAB 3: Your code here.
     unsigned int i = 0;
-    memset ((void *) envs, 0, NENV * sizeof (struct Env));
+    // The hot fields must fit the first cache line of each Env.
+    static_assert (offsetof (struct Env, env_tf) == ENV_HOT_BYTES);
+    // Clear the rest of the last page too: users see all of it.
+    memset ((void *) envs, 0, ROUNDUP (nenv * sizeof (struct Env), PGSIZE));
+    memset (env_sched, 0, nenv * sizeof (struct EnvSched));
+
+    env_region_cache = slab_cache_create ("env_regions",
+                                          ENV_NREGIONS
+                                          * sizeof (struct EnvRegion),
+                                          SLAB_COLOR_ALIGN, env_region_ctor);
 
     env_free_list = &envs[0];
-    for (i = 1; i < NENV; i++)
+    for (i = 1; i < nenv; i++)
     {
-        envs[i - 1].env_type = ENV_TYPE_IDLE;
         envs[i - 1].env_link = &envs[i];
     }
-    envs[NENV - 1].env_link = NIL;
+    envs[nenv - 1].env_link = NIL;
 
     // Per-CPU part of the initialization
     env_init_percpu ();
@@ -185,7 +272,7 @@ env_setup_vm (struct Env *e)
     pte_t *dst_pte = NIL;
 
     // Allocate a page for the page directory
-    if (!(p = page_alloc (ALLOC_ZERO)))
+    if (!(p = page_alloc (0)))
         return -E_NO_MEM;
 
     // Now, set e->env_pgdir and initialize the page directory.
@@ -216,7 +303,12 @@ env_setup_vm (struct Env *e)
 #endif
     e->env_pgdir = page2kva (p);
     kern_pgdir = get_kernpgdir ();
-    memmove (e->env_pgdir, kern_pgdir, PGSIZE);
+    // The user half starts out empty.  The kernel half points at the
+    // page tables shared with kern_pgdir, which never change after
+    // boot, so there is nothing else to copy or keep in sync.
+    memset (e->env_pgdir, 0, PDX (UTOP) * sizeof (pde_t));
+    memmove (e->env_pgdir + PDX (UTOP), kern_pgdir + PDX (UTOP),
+             (NPDENTRIES - PDX (UTOP)) * sizeof (pde_t));
     p->pp_ref++;
 #if 0
     for (i = PDX (UTOP); i < NPDENTRIES; i++)
@@ -251,7 +343,7 @@ env_setup_vm (struct Env *e)
 // On success, the new environment is stored in *newenv_store.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
-//  -E_NO_FREE_ENV if all NENVS environments are allocated
+//  -E_NO_FREE_ENV if all nenv environments are allocated
 //  -E_NO_MEM on memory exhaustion
 //
 int
@@ -262,24 +354,48 @@ env_alloc (struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
+	// Rather than fail, finish off an env that is being reclaimed.
+	while (!env_free_list && env_reclaim(ENV_RECLAIM_BATCH))
+		;
+	if (!env_free_list)
+		epoch_collect();
 	if (!(e = env_free_list))
 		return -E_NO_FREE_ENV;
 
+	// Its region table, with every slot unused.
+	if (!(e->env_regions = slab_alloc(env_region_cache)))
+		return -E_NO_MEM;
+
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		slab_free(env_region_cache, e->env_regions);
+		e->env_regions = NULL;
 		return r;
+	}
 
 	// Generate an env_id for this environment.
-	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
-	if (generation <= 0)	// Don't create a negative env_id.
+	generation = (e->env_id + (1 << ENVGENSHIFT)) & ENVGENMASK;
+	if (generation <= 0)	// Don't create a zero env_id.
 		generation = 1 << ENVGENSHIFT;
-	e->env_id = generation | (e - envs);
+	e->env_id = generation | ENVID_INDEX(e - envs);
 
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
-	e->env_runs = 0;
+	env_set_status(e, ENV_RUNNABLE);
+	env_set_runs(e, 0);
+	env_set_cpumask(e, ENV_CPUMASK_ALL);
+	e->env_quantum = 0;
+	e->env_gang = 0;
+	e->env_prio = SCHED_PRIO_DEFAULT;
+	e->env_rq_queued = 0;
+	e->env_rt_period = 0;
+	e->env_rt_misses = 0;
+	e->env_fpu = NULL;
+	e->env_fpu_cpu = -1;
+	e->env_share_next = e->env_share_prev = e;
+	e->env_utime = e->env_ktime = 0;
+	e->env_vswitches = e->env_ivswitches = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -310,13 +426,17 @@ env_alloc (struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_sa_upcall = 0;
+	e->env_sa_pending = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_nowait = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
+	sched_enqueue(e);
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 	return 0;
@@ -458,13 +578,14 @@ load_icode (struct Env *e, uint8_t * binary, size_t size)
     struct Proghdr *ph = NIL;
     struct Elf *elf = (struct Elf *) binary;
     uint32_t i = 0;
+    uintptr_t file_end, mem_end;
     if (ELF_MAGIC != elf->e_magic)
     {
         cprintf ("Error File header\n");
         return;
     }
     ph = (struct Proghdr *) ((uint8_t *) binary + elf->e_phoff);
-    lcr3 (PADDR (e->env_pgdir));
+    pgdir_load (e->env_pgdir);
     for (i = 0; i < elf->e_phnum; i++, ph++)
     {
         if (ph->p_type != ELF_PROG_LOAD)
@@ -478,11 +599,21 @@ load_icode (struct Env *e, uint8_t * binary, size_t size)
 #ifdef DEBUG_ENV_C
         cprintf(">>> ph->p_va:0x%08x %d Bytes pages:%d<<<\n",(uint32_t)ph->p_va, (uint32_t) ph->p_memsz,(uint32_t) ph->p_memsz%4096 ? ph->p_memsz/4096 +1 :ph->p_memsz/4096);
 #endif
-        region_alloc (e, (void *) ph->p_va, ph->p_memsz);
+        // Only pages holding file data are allocated now.  The rest
+        // of the bss is demand-zero, mapped as the program touches it.
+        file_end = MIN (ROUNDUP (ph->p_va + ph->p_filesz, PGSIZE),
+                        ph->p_va + ph->p_memsz);
+        mem_end = ROUNDUP (ph->p_va + ph->p_memsz, PGSIZE);
+        region_alloc (e, (void *) ph->p_va, file_end - ph->p_va);
         memmove ((void *) ph->p_va, (void *) (binary + ph->p_offset),
                  ph->p_filesz);
         memset ((void *) (ph->p_va + ph->p_filesz), 0,
-                ph->p_memsz - ph->p_filesz);
+                ROUNDUP (file_end, PGSIZE) - (ph->p_va + ph->p_filesz));
+        file_end = ROUNDUP (file_end, PGSIZE);
+        if (mem_end > file_end
+            && env_region_reserve (e, file_end, mem_end - file_end,
+                                   PTE_U | PTE_W) < 0)
+            panic ("load_icode: no region for the bss");
     }
 
     //Setup stack;
@@ -493,13 +624,13 @@ load_icode (struct Env *e, uint8_t * binary, size_t size)
     }
     /*Be careful about stack over usage. */
     //e->env_tf.tf_esp = USTACKTOP; 
-    memset ((void *) (e->env_tf.tf_esp - PGSIZE), 0, PGSIZE);
+    page_zero (page_lookup (e->env_pgdir, (void *) (USTACKTOP - PGSIZE), NULL));
 
     //Setup entry point
     e->env_tf.tf_eip = elf->e_entry;
 
     //Prob. Corresponding to env.h's problem         
-    lcr3 (PADDR (get_kernpgdir ()));
+    pgdir_load (get_kernpgdir ());
 
 }
 
@@ -534,72 +665,263 @@ env_create (uint8_t * binary, size_t size, enum EnvType type)
     e->env_parent_id = 0;
 }
 
+//
+// Reserve [va, va + len), page aligned and below UTOP, as demand-zero
+// memory in e.  Nothing is allocated now: the first touch of each page
+// faults, and env_region_fault maps a zeroed page with permissions
+// perm.  Returns -E_INVAL if the range overlaps one already reserved,
+// -E_NO_MEM if e has no free region slot.
+//
+int
+env_region_reserve (struct Env *e, uintptr_t va, size_t len, int perm)
+{
+    struct EnvRegion *r, *slot = NULL;
+
+    for (r = e->env_regions; r < e->env_regions + ENV_NREGIONS; r++)
+    {
+        if (r->er_start == r->er_end)
+        {
+            if (!slot)
+                slot = r;
+        }
+        else if (va < r->er_end && r->er_start < va + len)
+            return -E_INVAL;
+    }
+    if (!slot)
+        return -E_NO_MEM;
+
+    slot->er_start = va;
+    slot->er_end = va + len;
+    slot->er_perm = perm | PTE_P;
+    slot->er_group = 0;
+    return 0;
+}
+
+//
+// Find the region of e that contains va, or NULL.
+//
+static struct EnvRegion *
+env_region_find (struct Env *e, uintptr_t va)
+{
+    struct EnvRegion *r;
+
+    for (r = e->env_regions; r < e->env_regions + ENV_NREGIONS; r++)
+        if (va >= r->er_start && va < r->er_end)
+            return r;
+    return NULL;
+}
+
+//
+// If f is a live env whose region at va belongs to group, return that
+// region, or NULL.
+//
+static struct EnvRegion *
+env_region_group (struct Env *f, uintptr_t va, envid_t group)
+{
+    struct EnvRegion *r;
+
+    if (f->env_status == ENV_FREE || f->env_status == ENV_RECLAIM)
+        return NULL;
+    if (!(r = env_region_find (f, va)) || r->er_group != group)
+        return NULL;
+    return r;
+}
+
+//
+// Map a zeroed page at va if it lies in one of e's demand-zero regions.
+// For a shared region, the page is the one other envs of the group
+// already have there, or a new one mapped into all of them, so threads
+// always see the same page.
+// Returns 0 if va is now mapped, -E_FAULT if va is in no region,
+// -E_NO_MEM if there is no memory for the page.
+//
+int
+env_region_fault (struct Env *e, uintptr_t va)
+{
+    struct EnvRegion *r, *fr;
+    struct Env *f;
+    struct Page *p = NIL;
+    pte_t *pte;
+
+    if (!(r = env_region_find (e, va)))
+        return -E_FAULT;
+    va = ROUNDDOWN (va, PGSIZE);
+    // Another thread of the group mapped it while we waited.
+    pte = pgdir_walk (e->env_pgdir, (void *) va, NO_CREATE);
+    if (pte && (*pte & PTE_P))
+        return 0;
+
+    if (r->er_group)
+        for (f = e->env_share_next; f != e && !p; f = f->env_share_next)
+        {
+            if (!env_region_group (f, va, r->er_group))
+                continue;
+            pte = pgdir_walk (f->env_pgdir, (void *) va, NO_CREATE);
+            if (pte && (*pte & PTE_P))
+                p = pa2page (PTE_ADDR (*pte));
+        }
+
+    if (!p && NIL == (p = page_alloc (ALLOC_ZERO)))
+        return -E_NO_MEM;
+    if (page_insert (e->env_pgdir, p, (void *) va, r->er_perm) < 0)
+    {
+        if (!p->pp_ref)
+            page_free (p);
+        return -E_NO_MEM;
+    }
+
+    // Hand a new page to the rest of the group now; any that misses
+    // out finds it above on its own fault.
+    if (r->er_group && p->pp_ref == 1)
+        for (f = e->env_share_next; f != e; f = f->env_share_next)
+            if ((fr = env_region_group (f, va, r->er_group)))
+            {
+                pte = pgdir_walk (f->env_pgdir, (void *) va, NO_CREATE);
+                if (!pte || !(*pte & PTE_P))
+                    page_insert (f->env_pgdir, p, (void *) va, fr->er_perm);
+            }
+    return 0;
+}
+
+//
+// Make e's demand-zero regions shared: envs created from e by
+// sys_exofork inherit them, and from then on a page touched in any of
+// them is mapped in all.  Regions already shared keep their group.
+//
+void
+env_region_share (struct Env *e)
+{
+    struct EnvRegion *r;
+
+    for (r = e->env_regions; r < e->env_regions + ENV_NREGIONS; r++)
+        if (r->er_start != r->er_end && !r->er_group)
+            r->er_group = e->env_id;
+}
+
+//
+// Give child, just created from parent by sys_exofork, parent's
+// demand-zero regions.  If any are shared, child joins parent's ring,
+// the envs env_region_fault looks through for the other members of a
+// group: a group's members are its creator and envs descended from it.
+//
+void
+env_region_inherit (struct Env *child, struct Env *parent)
+{
+    struct EnvRegion *r;
+
+    memmove (child->env_regions, parent->env_regions,
+             ENV_NREGIONS * sizeof (struct EnvRegion));
+    for (r = child->env_regions; r < child->env_regions + ENV_NREGIONS; r++)
+        if (r->er_group)
+        {
+            child->env_share_next = parent->env_share_next;
+            child->env_share_prev = parent;
+            parent->env_share_next->env_share_prev = child;
+            parent->env_share_next = child;
+            return;
+        }
+}
+
 //
 // Frees env e and all memory it uses.
 //
 void
 env_free (struct Env *e)
 {
-    pte_t *pt;
-    uint32_t pdeno, pteno;
-    physaddr_t pa;
-
-    // If freeing the current environment, switch to kern_pgdir
-    // before freeing the page directory, just in case the page
-    // gets reused.
+    // If this CPU has e's page directory loaded (e is curenv, or
+    // ran here last), switch to kern_pgdir before freeing the page
+    // directory, just in case the page gets reused.
     /*
      * UPAGES space is already mapped.
      */
-    if (e == curenv)
-        lcr3 (PADDR (kern_pgdir));
+    if (e == curenv || thiscpu->cpu_pgdir == e->env_pgdir)
+        pgdir_load (kern_pgdir);
 
     // Note the environment's demise.
     cprintf ("[%08x] free env %08x\n", curenv ? curenv->env_id : 0,
              e->env_id);
 
-    // Flush all mapped pages in the user portion of the address space
-    static_assert (UTOP % PTSIZE == 0);
-    for (pdeno = 0; pdeno < PDX (UTOP); pdeno++)
-    {
-
-        // only look at mapped page tables
-        if (!(e->env_pgdir[pdeno] & PTE_P))
-            continue;
+    fpu_free (e);
+    sched_rt_release (e);
+    sched_dequeue (e);
+    e->env_share_prev->env_share_next = e->env_share_next;
+    e->env_share_next->env_share_prev = e->env_share_prev;
+    e->env_share_next = e->env_share_prev = e;
+    // The region table goes back the way env_region_ctor made it.
+    memset (e->env_regions, 0, ENV_NREGIONS * sizeof (struct EnvRegion));
+    slab_free (env_region_cache, e->env_regions);
+    e->env_regions = NULL;
+
+    // Unmapping every page can take a long time with the kernel lock
+    // held.  Hand the address space to env_reclaim, which tears it
+    // down a bounded chunk at a time from timer ticks and idle CPUs.
+    // xchg orders the store before env_reclaim's read of env_ref.
+    xchg (&e->env_status, ENV_RECLAIM);
+    ENV_SCHED (e)->es_status = ENV_RECLAIM;
+    e->env_link = NULL;
+    *env_reclaim_tail = e;
+    env_reclaim_tail = &e->env_link;
+}
 
-        // find the pa and va of the page table
-        pa = PTE_ADDR (e->env_pgdir[pdeno]);
-        /*
-           Prob:
-           * Why Virtual ?!
-           * Ans: 
-           *      0. Currently, it is protected mode now.
-           *      1. Link to the KERNBASE
-           *      2. boot_map_region : map phy:0 to vir:KERNBASE
-           *                           doesn't map anything to  vir: 0
-         */
-        pt = (pte_t *) KADDR (pa);
+//
+// Tear down the address spaces of freed environments, removing about
+// 'budget' pages (whole page tables at a time), and retire each env
+// whose teardown finishes with epoch_retire_env; env_recycle puts it
+// back on env_free_list once no CPU can still be reading it.  Envs that
+// a lookup still holds (env_ref) are left for a later call.  Returns
+// true if there is work left that can be done.
+//
+bool
+env_reclaim (int budget)
+{
+    struct Env *e, **pp = &env_reclaim_list;
+    struct Page *pg;
+    uint32_t pdeno;
+    physaddr_t pa;
 
-        // unmap all PTEs in this page table
-        for (pteno = 0; pteno <= PTX (~0); pteno++)
+    while ((e = *pp))
+    {
+        if (e->env_ref)
+        {
+            pp = &e->env_link;
+            continue;
+        }
+        // A page table at a time: page_remove_range frees each one
+        // it empties, so the next pass picks up where this one stopped.
+        static_assert (UTOP % PTSIZE == 0);
+        for (pdeno = 0; pdeno < PDX (UTOP); pdeno++)
         {
-            if (pt[pteno] & PTE_P)
-                page_remove (e->env_pgdir, PGADDR (pdeno, pteno, 0));
+            // only look at mapped page tables
+            if (!(e->env_pgdir[pdeno] & PTE_P))
+                continue;
+            if (budget <= 0)
+                return 1;
+            budget -= page_remove_range (e->env_pgdir,
+                                         PGADDR (pdeno, 0, 0), PTSIZE);
         }
 
-        // free the page table itself
-        e->env_pgdir[pdeno] = 0;
-        page_decref (pa2page (pa));
-    }
+        // free the page directory, once no other CPU can be walking it
+        pa = PADDR (e->env_pgdir);
+        e->env_pgdir = 0;
+        pg = pa2page (pa);
+        if (--pg->pp_ref == 0)
+            epoch_retire_page (pg);
 
-    // free the page directory
-    pa = PADDR (e->env_pgdir);
-    e->env_pgdir = 0;
-    page_decref (pa2page (pa));
+        if (!(*pp = e->env_link))
+            env_reclaim_tail = pp;
+
+        // return the environment to the free list, once no other CPU
+        // can still be reading it
+        epoch_retire_env (e);
+    }
+    return 0;
+}
 
-    // return the environment to the free list
-    e->env_status = ENV_FREE;
-    //Is it needed?
-    //e->env_type = ENV_TYPE_IDLE;
+// Put e, whose teardown is done, back on the free list.
+void
+env_recycle (struct Env *e)
+{
+    env_set_status (e, ENV_FREE);
     e->env_link = env_free_list;
     env_free_list = e;
 }
@@ -616,7 +938,7 @@ env_destroy (struct Env *e)
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
 	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+		env_set_status(e, ENV_DYING);
 		return;
 	}
 
@@ -639,7 +961,7 @@ void
 env_pop_tf (struct Trapframe *tf)
 {
 	// Record the CPU we are running on for user-space debugging
-	curenv->env_cpunum = cpunum();
+	env_set_cpunum(curenv, cpunum());
 
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
@@ -651,6 +973,43 @@ env_pop_tf (struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+//
+// Deliver e's pending scheduler activation events: push a UTrapframe
+// with the events in utf_err onto its exception stack and resume it at
+// env_sa_upcall instead, so its user-level scheduler may run another
+// thread.  Events wait while e is on the exception stack already (in a
+// page fault handler or the upcall itself).  e's page directory must
+// be loaded.
+//
+static void
+env_sa_deliver (struct Env *e)
+{
+    struct UTrapframe *utf;
+    struct Trapframe *tf = &e->env_tf;
+
+    if (!e->env_sa_pending || !e->env_sa_upcall)
+        return;
+    if (tf->tf_esp >= UXSTACKBASE && tf->tf_esp <= UXSTACKTOP)
+        return;
+
+    utf = (struct UTrapframe *) (UXSTACKTOP - sizeof (*utf));
+    if (user_mem_check (e, utf, sizeof (*utf), PTE_U | PTE_W) < 0)
+    {
+        // No exception stack: nobody to tell.
+        e->env_sa_pending = 0;
+        return;
+    }
+    utf->utf_fault_va = 0;
+    utf->utf_err = e->env_sa_pending;
+    utf->utf_regs = tf->tf_regs;
+    utf->utf_eip = tf->tf_eip;
+    utf->utf_eflags = tf->tf_eflags;
+    utf->utf_esp = tf->tf_esp;
+    tf->tf_esp = (uintptr_t) utf;
+    tf->tf_eip = (uintptr_t) e->env_sa_upcall;
+    e->env_sa_pending = 0;
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
@@ -679,23 +1038,42 @@ env_run (struct Env *e)
 
     // LAB 3: Your code here.
 
+    uint64_t now = read_tsc();
+
+    // The system call that looked envs up is over.
+    env_drop_refs ();
     if (NIL != curenv)
     {
+        // Kernel time since the trap belongs to the env that trapped.
+        curenv->env_ktime += now - thiscpu->cpu_tsc_mark;
         if (ENV_RUNNING == curenv->env_status)
-            curenv->env_status = ENV_RUNNABLE;
+        {
+            env_set_status (curenv, ENV_RUNNABLE);
+            sched_enqueue (curenv);
+        }
         /*Hawx:
          *Other state could be in- like: waiting for I/O so as to be ENV_NOT_RUNNABLE
          */
     }
     curenv = e;
-    curenv->env_status = ENV_RUNNING;
-    curenv->env_runs++;
+    env_set_status (curenv, ENV_RUNNING);
+    sched_dequeue (curenv);
+    env_set_runs (curenv, curenv->env_runs + 1);
 //  curenv->env_tf.tf_eflags =   FL_IF |  curenv->env_tf.tf_eflags;
     //cprintf("trap's  curenv_id:0x%8x, cpunum:%d\n",curenv->env_id,cpunum()); //Debug
 
     //No one can ensure the new feature in the near future that kernel mapping's physical page won't be different from the user mapping's phsycal page.
+    thiscpu->cpu_tsc_mark = now;
+    // Leaving the kernel or the idle loop for the env whose page
+    // directory is still loaded needs no CR3 reload, unless another
+    // CPU changed its mappings in the meantime (see tlb_invalidate).
+    if (thiscpu->cpu_pgdir != curenv->env_pgdir || thiscpu->cpu_tlb_stale)
+        pgdir_load (curenv->env_pgdir);
+    env_sa_deliver (curenv);
+    fpu_switch (curenv);
+    // Leaving the kernel: nothing retired is held past here.
+    epoch_exit ();
     unlock_kernel();
-    lcr3 (PADDR (curenv->env_pgdir));
     env_pop_tf (&curenv->env_tf);
 
     panic ("env_run not yet implemented");
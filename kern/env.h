@@ -8,17 +8,72 @@
 
 //extern struct Env *curenv;      // Current environment
 extern struct Env *envs;		// All environments
+extern uint32_t nenv;			// ... how many, at most NENV
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// What a scan over the environments reads of each, four to a cache
+// line, in an array of its own: env_sched[i] shadows envs[i], which
+// stays the full copy that users read through UENVS.  The kernel
+// changes these fields only through the helpers below, which write
+// both copies.
+struct EnvSched {
+	uint32_t es_status;
+	uint32_t es_cpumask;
+	int es_cpunum;
+	uint32_t es_runs;
+};
+
+extern struct EnvSched *env_sched;	// nenv entries, page aligned
+#define ENV_SCHED(e)	(&env_sched[(e) - envs])
+
+static inline void
+env_set_status(struct Env *e, unsigned status)
+{
+	e->env_status = status;
+	ENV_SCHED(e)->es_status = status;
+}
+
+static inline void
+env_set_cpumask(struct Env *e, uint32_t cpumask)
+{
+	e->env_cpumask = cpumask;
+	ENV_SCHED(e)->es_cpumask = cpumask;
+}
+
+static inline void
+env_set_cpunum(struct Env *e, int cpu)
+{
+	e->env_cpunum = cpu;
+	ENV_SCHED(e)->es_cpunum = cpu;
+}
+
+static inline void
+env_set_runs(struct Env *e, uint32_t runs)
+{
+	e->env_runs = runs;
+	ENV_SCHED(e)->es_runs = runs;
+}
+
 void env_init (void);
 void env_init_percpu (void);
 int env_alloc (struct Env **e, envid_t parent_id);
 void env_free (struct Env *e);
 void env_create (uint8_t * binary, size_t size, enum EnvType type);
 void env_destroy (struct Env *e);   // Does not return if e == curenv
+bool env_reclaim (int budget);
+void env_recycle (struct Env *e);
+int env_region_reserve (struct Env *e, uintptr_t va, size_t len, int perm);
+int env_region_fault (struct Env *e, uintptr_t va);
+void env_region_share (struct Env *e);
+void env_region_inherit (struct Env *child, struct Env *parent);
+
+// Pages env_reclaim tears down per timer tick or idle pass; it always
+// finishes the page table it is working on.
+#define ENV_RECLAIM_BATCH	256
 
 int envid2env (envid_t envid, struct Env **env_store, bool checkperm);
+void env_drop_refs (void);
 // The following two functions do not return
 void env_run (struct Env *e) __attribute__ ((noreturn));
 void env_pop_tf (struct Trapframe *tf) __attribute__ ((noreturn));
@@ -0,0 +1,133 @@
+// Epoch-based reclamation.
+//
+// Code that reads an Env or a page table without the kernel lock may
+// still hold a pointer to it after another CPU has unlinked and freed
+// it.  So freeing is split in two: the object is unlinked and retired
+// now, and recycled only once every CPU has gone through a quiescent
+// point since, a moment at which it holds no such pointer.
+//
+// A CPU is quiescent outside the kernel (in user mode or halted) and
+// whenever it enters it: epoch_enter, at trap() entry, announces the
+// current epoch in cpu_epoch, and epoch_exit, on the way out through
+// env_run or sched_halt, sets EPOCH_IDLE.  Once every CPU has announced
+// epoch g or is idle, none can still hold what was retired in epoch
+// g - 1, and epoch_collect moves the epoch on to g + 1 and recycles
+// those objects.  Objects retired in epoch e wait in bucket e % 3.
+//
+// Retiring and collecting run with the kernel lock held; announcing
+// takes no lock.
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/epoch.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+
+#define EPOCH_NBUCKETS	3
+
+struct EpochBucket {
+	struct Env *eb_envs;		// Retired Envs, linked by env_link
+	struct Page *eb_pages;		// Retired pages, linked by pp_link
+};
+
+static volatile uint32_t epoch_global = 1;	// Never EPOCH_IDLE
+static struct EpochBucket epoch_buckets[EPOCH_NBUCKETS];
+
+void
+epoch_enter(void)
+{
+	xchg(&thiscpu->cpu_epoch, load_acquire(&epoch_global));
+}
+
+void
+epoch_exit(void)
+{
+	xchg(&thiscpu->cpu_epoch, EPOCH_IDLE);
+}
+
+// Hand e, whose teardown is done, to env_recycle once no CPU can still
+// be reading it.
+void
+epoch_retire_env(struct Env *e)
+{
+	struct EpochBucket *b = &epoch_buckets[epoch_global % EPOCH_NBUCKETS];
+
+	e->env_link = b->eb_envs;
+	b->eb_envs = e;
+}
+
+// Put pp, whose last reference is gone, back on the free list once no
+// CPU can still be reading it.
+void
+epoch_retire_page(struct Page *pp)
+{
+	struct EpochBucket *b = &epoch_buckets[epoch_global % EPOCH_NBUCKETS];
+
+	pp->pp_link = b->eb_pages;
+	b->eb_pages = pp;
+}
+
+static bool
+epoch_pending(void)
+{
+	int i;
+
+	for (i = 0; i < EPOCH_NBUCKETS; i++)
+		if (epoch_buckets[i].eb_envs || epoch_buckets[i].eb_pages)
+			return 1;
+	return 0;
+}
+
+// Has every CPU announced epoch g, or left the kernel?
+static bool
+epoch_caught_up(uint32_t g)
+{
+	uint32_t e;
+	int c;
+
+	for (c = 0; c < ncpu; c++) {
+		e = load_acquire(&cpus[c].cpu_epoch);
+		if (e != g && e != EPOCH_IDLE)
+			return 0;
+	}
+	return 1;
+}
+
+static void
+epoch_free(struct EpochBucket *b)
+{
+	struct Env *e;
+	struct Page *pp;
+
+	while ((e = b->eb_envs)) {
+		b->eb_envs = e->env_link;
+		env_recycle(e);
+	}
+	while ((pp = b->eb_pages)) {
+		b->eb_pages = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
+// Recycle what is safe to recycle.  The caller must hold the kernel
+// lock and no pointer to a retired object: this is a quiescent point
+// for it.  Returns true if objects are left waiting for other CPUs.
+bool
+epoch_collect(void)
+{
+	uint32_t g;
+
+	epoch_enter();
+	while (epoch_pending() && epoch_caught_up((g = epoch_global))) {
+		if (++g == EPOCH_IDLE)
+			g++;
+		xchg(&epoch_global, g);
+		epoch_enter();
+		// Retired two epochs ago.
+		epoch_free(&epoch_buckets[(g + 1) % EPOCH_NBUCKETS]);
+	}
+	return epoch_pending();
+}
@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_EPOCH_H
+#define JOS_KERN_EPOCH_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+struct Page;
+
+// cpu_epoch of a CPU outside the kernel, which holds nothing.
+#define EPOCH_IDLE	0
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire_env(struct Env *e);
+void epoch_retire_page(struct Page *pp);
+bool epoch_collect(void);
+
+#endif	// !JOS_KERN_EPOCH_H
@@ -0,0 +1,192 @@
+// Lazy FPU/SSE context switching.
+//
+// Most environments never touch the FPU, so its registers are not
+// part of the context switch.  env_run sets CR0.TS, and the first FPU
+// or SSE instruction an environment executes in a timeslice raises
+// T_DEVICE (#NM); only then is its state loaded.  Each CPU's FPU keeps
+// the state of the last environment that used it (cpu_fpu_owner), so
+// an environment that comes back to the same CPU with nobody else
+// touching the FPU in between reloads nothing.  The state is written
+// back to the environment's save area only when a timeslice in which
+// it used the FPU ends (cpu_fpu_dirty).
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/fpu.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/slab.h>
+
+#define CPUID_FXSR	(1 << 24)	// CPUID.1:EDX, FXSAVE/FXRSTOR
+#define CPUID_SSE	(1 << 25)	// CPUID.1:EDX, SSE
+
+static bool fpu_fxsr;
+// Save areas, seven to a page.
+static struct SlabCache *fpu_cache;
+// The state every environment starts with.
+static struct FpuState fpu_initial;
+
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+static inline void
+stts(void)
+{
+	uint32_t cr0 = rcr0();
+
+	if (!(cr0 & CR0_TS))
+		lcr0(cr0 | CR0_TS);
+}
+
+static inline void
+fxsave(struct FpuState *fs)
+{
+	asm volatile("fxsave %0" : "=m" (*fs));
+}
+
+static inline void
+fxrstor(struct FpuState *fs)
+{
+	asm volatile("fxrstor %0" : : "m" (*fs));
+}
+
+// Give e a save area holding the initial FPU state.
+static int
+fpu_alloc(struct Env *e)
+{
+	if (!(e->env_fpu = slab_alloc(fpu_cache)))
+		return -E_NO_MEM;
+	*e->env_fpu = fpu_initial;
+	return 0;
+}
+
+// Enable the FPU on this CPU, with CR0.TS set so the first use traps.
+void
+fpu_init_percpu(void)
+{
+	uint32_t cr0;
+
+	if (fpu_fxsr)
+		lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	cr0 = rcr0();
+	cr0 |= CR0_MP | CR0_NE | CR0_TS;
+	cr0 &= ~CR0_EM;
+	lcr0(cr0);
+	thiscpu->cpu_fpu_owner = NULL;
+	thiscpu->cpu_fpu_dirty = 0;
+}
+
+void
+fpu_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	fpu_fxsr = (edx & CPUID_FXSR) != 0;
+	if (!fpu_fxsr)
+		cprintf("FPU: no FXSAVE/FXRSTOR, user FPU use is fatal\n");
+
+	// What fninit sets up, with all SSE exceptions masked.
+	memset(&fpu_initial, 0, sizeof(fpu_initial));
+	fpu_initial.fs_fcw = 0x037F;
+	if (edx & CPUID_SSE)
+		fpu_initial.fs_mxcsr = 0x1F80;
+
+	fpu_cache = slab_cache_create("fpu", sizeof(struct FpuState),
+				      __alignof__(struct FpuState), NULL);
+
+	fpu_init_percpu();
+}
+
+// curenv used the FPU while CR0.TS was set.  Load its state, unless
+// this FPU still holds it, and let it run with the FPU enabled for the
+// rest of the timeslice.
+void
+fpu_trap(void)
+{
+	struct Env *e = curenv;
+
+	if (!fpu_fxsr) {
+		cprintf("[%08x] FPU not supported\n", e->env_id);
+		env_destroy(e);
+		return;
+	}
+	if (!e->env_fpu && fpu_alloc(e) < 0) {
+		cprintf("[%08x] out of memory for FPU state\n", e->env_id);
+		env_destroy(e);
+		return;
+	}
+
+	// Nobody is dirty here: that would mean TS was already clear.
+	clts();
+	if (thiscpu->cpu_fpu_owner != e || e->env_fpu_cpu != cpunum()) {
+		fxrstor(e->env_fpu);
+		thiscpu->cpu_fpu_owner = e;
+		e->env_fpu_cpu = cpunum();
+	}
+	thiscpu->cpu_fpu_dirty = 1;
+}
+
+// Write this CPU's FPU state back to its owner's save area if the
+// owner changed it, so that the owner can run on another CPU.
+// The registers keep the state, so the owner may still reuse them.
+void
+fpu_save(void)
+{
+	if (!thiscpu->cpu_fpu_dirty)
+		return;
+	fxsave(thiscpu->cpu_fpu_owner->env_fpu);
+	thiscpu->cpu_fpu_dirty = 0;
+}
+
+// env_run is about to run e on this CPU.
+void
+fpu_switch(struct Env *e)
+{
+	// e used the FPU this timeslice and is just going back to user
+	// mode: leave the FPU enabled.
+	if (thiscpu->cpu_fpu_dirty && thiscpu->cpu_fpu_owner == e)
+		return;
+	fpu_save();
+	stts();
+}
+
+// Give child a copy of parent's FPU state.
+int
+fpu_fork(struct Env *child, struct Env *parent)
+{
+	if (!parent->env_fpu)
+		return 0;
+	// The parent keeps running with the FPU enabled, so save without
+	// ending its use of the FPU.
+	if (thiscpu->cpu_fpu_dirty && thiscpu->cpu_fpu_owner == parent)
+		fxsave(parent->env_fpu);
+	if (fpu_alloc(child) < 0)
+		return -E_NO_MEM;
+	*child->env_fpu = *parent->env_fpu;
+	return 0;
+}
+
+// Forget e's FPU state.  e is not running anywhere.
+void
+fpu_free(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_owner == e) {
+		thiscpu->cpu_fpu_owner = NULL;
+		thiscpu->cpu_fpu_dirty = 0;
+	}
+	// Other CPUs may still name e as owner; this invalidates that.
+	e->env_fpu_cpu = -1;
+	if (e->env_fpu) {
+		slab_free(fpu_cache, e->env_fpu);
+		e->env_fpu = NULL;
+	}
+}
@@ -0,0 +1,39 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// The FXSAVE/FXRSTOR image of the x87, MMX and SSE registers.
+struct FpuState {
+	uint16_t fs_fcw;		// x87 control word
+	uint16_t fs_fsw;		// x87 status word
+	uint8_t fs_ftw;			// Abridged tag word
+	uint8_t fs_reserved0;
+	uint16_t fs_fop;
+	uint32_t fs_fip;
+	uint16_t fs_fcs;
+	uint16_t fs_reserved1;
+	uint32_t fs_fdp;
+	uint16_t fs_fds;
+	uint16_t fs_reserved2;
+	uint32_t fs_mxcsr;		// SSE control/status
+	uint32_t fs_mxcsr_mask;
+	uint8_t fs_regs[480];		// ST0-7/MM0-7, XMM0-7, reserved
+} __attribute__((aligned(16)));
+
+void fpu_init(void);
+void fpu_init_percpu(void);
+void fpu_trap(void);
+void fpu_switch(struct Env *e);
+void fpu_save(void);
+int fpu_fork(struct Env *child, struct Env *parent);
+void fpu_free(struct Env *e);
+
+#endif	// !JOS_KERN_FPU_H
@@ -11,6 +11,8 @@
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
+#include <kern/fpu.h>
+#include <kern/slab.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
@@ -40,9 +42,12 @@ i386_init (void)
     env_init ();
     //Includes Init Main Processor.
     trap_init ();
+    fpu_init ();
+    check_slab ();
 
     // Lab 4 multiprocessor initialization functions
     mp_init();
+    kclock_init();
     lapic_init();
 
     // Lab 4 multitasking initialization functions
@@ -55,11 +60,6 @@ i386_init (void)
     // Starting non-boot CPUs
     boot_aps();
 
-    // Should always have idle processes at first.
-    int i;
-    for (i = 0; i < NCPU; i++)
-        ENV_CREATE(user_idle, ENV_TYPE_IDLE);
-
 #if defined(TEST)
     // Don't touch -- used by grading script!
     ENV_CREATE (TEST, ENV_TYPE_USER);
@@ -126,13 +126,14 @@ boot_aps(void)
 mp_main(void)
 {
     // We are in high EIP now, safe to switch to kern_pgdir 
-    lcr3(PADDR(kern_pgdir));
+    pgdir_load(kern_pgdir);
     cprintf("SMP: CPU %d starting\n", cpunum());
 
     lapic_init();
     env_init_percpu();
     //Init Other Procsssors
     trap_init_percpu();
+    fpu_init_percpu();
     xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
     // Now that we have finished some basic setup, call sched_yield()
@@ -1,11 +1,83 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock,
+ * and for calibrating the TSC against the PIT. */
 
 #include <inc/x86.h>
+#include <inc/stdio.h>
 
 #include <kern/kclock.h>
 
+#define CALIBRATE_MS		10          /* length of the PIT reference window */
+#define TSC_KHZ_DEFAULT		1000000     /* assume 1GHz if calibration fails */
+
+uint32_t tsc_khz;
+static uint64_t tsc_boot;
+
+// Count TSC cycles across a CALIBRATE_MS one-shot on PIT channel 2,
+// whose output is readable through port B without any interrupts.
+// Returns 0 if the PIT never expires (no PIT, or a broken one).
+static uint32_t
+tsc_calibrate_pit (void)
+{
+    uint32_t latch = TIMER_FREQ / (1000 / CALIBRATE_MS);
+    uint64_t start, end;
+    uint32_t spins = 0;
+
+    // Gate channel 2 on, speaker off.
+    outb (IO_PPI, (inb (IO_PPI) & ~0x02) | 0x01);
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count).
+    outb (IO_TIMER1 + 3, 0xB0);
+    outb (IO_TIMER1 + 2, latch & 0xff);
+    outb (IO_TIMER1 + 2, latch >> 8);
+
+    start = read_tsc ();
+    while (!(inb (IO_PPI) & 0x20))
+        if (++spins == 0x10000000)
+            return 0;
+    end = read_tsc ();
+
+    return (end - start) / CALIBRATE_MS;
+}
+
+// Calibrate the TSC and start the nanosecond clock.
+// Must run on the BSP before the APs and the LAPIC timer need it.
+void
+kclock_init (void)
+{
+    tsc_khz = tsc_calibrate_pit ();
+    if (tsc_khz == 0)
+    {
+        cprintf ("kclock: TSC calibration failed, assuming %u kHz\n",
+                 TSC_KHZ_DEFAULT);
+        tsc_khz = TSC_KHZ_DEFAULT;
+    }
+    tsc_boot = read_tsc ();
+    cprintf ("TSC: %u.%03u MHz\n", tsc_khz / 1000, tsc_khz % 1000);
+}
+
+// Nanoseconds since kclock_init.  Monotonic as long as the TSC is,
+// which holds for the constant-rate, synchronized TSCs of the CPUs
+// (and emulators) that JOS runs on.
+uint64_t
+time_ns (void)
+{
+    uint64_t cycles = read_tsc () - tsc_boot;
+
+    // Split the division so cycles * 10^6 can't overflow.
+    return (cycles / tsc_khz) * 1000000 +
+        (cycles % tsc_khz) * 1000000 / tsc_khz;
+}
+
+// Spin for at least 'us' microseconds.
+void
+tsc_delay_us (uint32_t us)
+{
+    uint64_t end = read_tsc () + (uint64_t) us * tsc_khz / 1000;
+
+    while (read_tsc () < end)
+        asm volatile ("pause");
+}
 
 unsigned
 mc146818_read (unsigned reg)
@@ -8,6 +8,10 @@
 
 #define	IO_RTC		0x070       /* RTC port */
 
+#define	IO_TIMER1	0x040       /* 8253/8254 PIT */
+#define	TIMER_FREQ	1193182     /* PIT input clock, in Hz */
+#define	IO_PPI		0x061       /* port B: PIT channel 2 gate/output */
+
 #define	MC_NVRAM_START	0xe     /* start of NVRAM: offset 14 */
 #define	MC_NVRAM_SIZE	50      /* 50 bytes of NVRAM */
 
@@ -26,7 +30,13 @@
 /* NVRAM byte 36: current century.  (please increment in Dec99!) */
 #define NVRAM_CENTURY	(MC_NVRAM_START + 36)   /* RTC offset 0x32 */
 
-//void kclock_init (void);
+#include <inc/types.h>
+
+extern uint32_t tsc_khz;            /* TSC cycles per millisecond */
+
+void kclock_init (void);
+uint64_t time_ns (void);
+void tsc_delay_us (uint32_t us);
 unsigned mc146818_read (unsigned reg);
 void mc146818_write (unsigned reg, unsigned datum);
 
@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -44,6 +45,12 @@
 
 volatile uint32_t *lapic;  // Initialized in mp.c
 
+#define CALIBRATE_US		10000
+// What the old uncalibrated TICR of 10^7 per 10ms tick assumed.
+#define TICKS_PER_US_DEFAULT	1000
+
+uint32_t lapic_ticks_per_us;	// Timer counts per microsecond, at divide-by-1
+
 static void
 lapicw(int index, int value)
 {
@@ -51,6 +58,28 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure the timer's count rate against the calibrated TSC.
+static void
+lapic_calibrate(void)
+{
+	uint32_t elapsed;
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xFFFFFFFF);
+	tsc_delay_us(CALIBRATE_US);
+	elapsed = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_ticks_per_us = elapsed / CALIBRATE_US;
+	if (lapic_ticks_per_us == 0) {
+		cprintf("LAPIC timer calibration failed, assuming %u ticks/us\n",
+			TICKS_PER_US_DEFAULT);
+		lapic_ticks_per_us = TICKS_PER_US_DEFAULT;
+	}
+	cprintf("LAPIC timer: %u ticks/us\n", lapic_ticks_per_us);
+}
+
 void
 lapic_init(void)
 {
@@ -60,13 +89,15 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  All CPUs share the bus clock,
+	// so the BSP calibrates it once against the TSC.  It stays idle
+	// until the scheduler arms it one-shot for a timeslice.
+	if (thiscpu == bootcpu)
+		lapic_calibrate();
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, 0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -122,15 +153,36 @@ lapic_eoi(void)
 		lapicw(EOI, 0);
 }
 
+// Interrupt this CPU once, 'us' microseconds from now.
+void
+lapic_timer_arm(uint32_t us)
+{
+	uint64_t count = (uint64_t)us * lapic_ticks_per_us;
+
+	if (!lapic)
+		return;
+	if (count == 0)
+		count = 1;
+	if (count > 0xFFFFFFFF)
+		count = 0xFFFFFFFF;
+	lapicw(TICR, count);
+}
+
+// Cancel this CPU's pending timer interrupt, if any.
+void
+lapic_timer_stop(void)
+{
+	if (lapic)
+		lapicw(TICR, 0);
+}
+
 // Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
 static void
 microdelay(int us)
 {
+	tsc_delay_us(us);
 }
 
-#define IO_RTC  0x70
-
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
@@ -175,3 +227,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an interrupt to the CPU whose local APIC ID is 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -11,6 +11,10 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/kclock.h>
+#include <kern/slab.h>
 
 #define CMDBUF_SIZE	80          // enough for one VGA text line
 
@@ -28,6 +32,9 @@ static struct Command commands[] = {
     {"help", "Display this list of commands", mon_help},
     {"kerninfo", "Display information about the kernel", mon_kerninfo},
     {"backtrace", "Display current calling stack", mon_backtrace},
+    {"top", "List the environments using the most CPU time", mon_top},
+    {"schedbench", "Time picking the next env and scanning envs[]", mon_schedbench},
+    {"slabinfo", "Show the kernel slab caches", mon_slabinfo},
 };
 
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -106,6 +113,108 @@ mon_backtrace (int argc, char **argv, struct Trapframe *tf)
 }
 
 
+static uint64_t
+env_cycles (struct Env *e)
+{
+    return e->env_utime + e->env_ktime;
+}
+
+// Does envs[i] sort before envs[j]?  Busiest first, then by slot.
+static bool
+top_before (int i, int j)
+{
+    uint64_t ci = env_cycles (&envs[i]), cj = env_cycles (&envs[j]);
+    return ci > cj || (ci == cj && i < j);
+}
+
+int
+mon_top (int argc, char **argv, struct Trapframe *tf)
+{
+    int n = 10, shown, i, last = -1, best;
+
+    if (argc > 1)
+        n = strtol (argv[1], NULL, 0);
+
+    cprintf ("  envid    status  runs  user-cycles   kern-cycles   vsw   ivsw\n");
+    // Selection by rank: each pass finds the busiest env ranked after
+    // the one printed last.  Slow, but the monitor is not a hot path.
+    for (shown = 0; shown < n; shown++)
+    {
+        best = -1;
+        for (i = 0; i < nenv; i++)
+        {
+            if (envs[i].env_status == ENV_FREE
+                || envs[i].env_status == ENV_RECLAIM)
+                continue;
+            if (last >= 0 && !top_before (last, i))
+                continue;
+            if (best < 0 || top_before (i, best))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        cprintf ("  %08x %6d %5d  %12llu  %12llu  %5d  %5d\n",
+                 envs[best].env_id, envs[best].env_status,
+                 envs[best].env_runs, envs[best].env_utime,
+                 envs[best].env_ktime, envs[best].env_vswitches,
+                 envs[best].env_ivswitches);
+        last = best;
+    }
+    return 0;
+}
+
+static void
+mon_scanline (const char *what, struct SchedScan *s)
+{
+    cprintf ("  %-12s %4u cycles per env, ", what, s->ss_cycles);
+    if (s->ss_misses == ~0U)
+        cprintf ("LLC misses not counted\n");
+    else
+        cprintf ("%u LLC misses per 1000 envs\n", s->ss_misses);
+}
+
+int
+mon_schedbench (int argc, char **argv, struct Trapframe *tf)
+{
+    static const int sizes[] = { 10, 100, 1000 };
+    struct SchedScan compact, full;
+    uint32_t cycles;
+    int i;
+
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    {
+        if (!(cycles = sched_bench (sizes[i])))
+        {
+            cprintf ("%5d runnable: not enough free envs\n", sizes[i]);
+            continue;
+        }
+        cprintf ("%5d runnable: %u cycles (%u ns) per pick\n", sizes[i],
+                 cycles, (uint32_t) ((uint64_t) cycles * 1000000 / tsc_khz));
+    }
+    sched_scan_bench (&compact, &full);
+    cprintf ("scan of %u envs:\n", nenv);
+    mon_scanline ("env_sched[]", &compact);
+    mon_scanline ("envs[]", &full);
+    return 0;
+}
+
+int
+mon_slabinfo (int argc, char **argv, struct Trapframe *tf)
+{
+    struct SlabCache *sc;
+    uint32_t cached;
+
+    cprintf ("  cache         size  in-use  cpu-free  slab-free  slabs  per-slab\n");
+    for (sc = slab_caches; sc < slab_caches + slab_ncaches; sc++)
+    {
+        cached = slab_cpu_cached (sc);
+        cprintf ("  %-12s %5d  %6d  %8d  %9d  %5d  %8d\n", sc->sc_name,
+                 sc->sc_size, sc->sc_inuse - cached, cached,
+                 sc->sc_nslabs * sc->sc_perslab - sc->sc_inuse,
+                 sc->sc_nslabs, sc->sc_perslab);
+    }
+    return 0;
+}
 
 /***** Kernel monitor command interpreter *****/
 
@@ -15,5 +15,8 @@ void monitor (struct Trapframe *tf);
 int mon_help (int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo (int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace (int argc, char **argv, struct Trapframe *tf);
+int mon_top (int argc, char **argv, struct Trapframe *tf);
+int mon_schedbench (int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo (int argc, char **argv, struct Trapframe *tf);
 
 #endif // !JOS_KERN_MONITOR_H
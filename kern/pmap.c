@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/epoch.h>
 
 //#define __ALL_COUNT__
 
@@ -17,6 +18,11 @@
 #define __PT_REF__
 #define __PD_REF__
 #endif
+
+// Largest range tlb_invalidate_range flushes page by page.
+#define TLB_INVLPG_MAX 32
+// envs[] gets at most this fraction of physical memory.
+#define ENV_TABLE_SHARE 16
 // These variables are set by i386_detect_memory()
 size_t npages;                  // Amount of physical memory (in pages)
 static size_t nAvailPages;      //Hawx: Amount of available physical memory (in pages) 
@@ -28,7 +34,16 @@ static size_t UpperMemBound;    // Amount of base memory (in pages)
 pde_t *kern_pgdir;              // Kernel's initial page directory
 struct Page *pages;             // Physical page state array
 static struct Page *page_free_list; // Free list of physical pages
+// Pages zeroed ahead of time by idle CPUs, so that most ALLOC_ZERO
+// requests (demand-zero faults, sys_page_alloc) find one ready.
+// Linked by pp_link like page_free_list.
+static struct Page *page_zero_pool;
+static int page_zero_pool_n;
 static struct Page *tail_free_page; // Free list of physical pages
+// Set once every kernel page table exists.  From then on the kernel
+// half of kern_pgdir never changes, and every env page directory
+// shares its page tables (see env_setup_vm).
+static bool kern_pgtables_frozen;
 
 //Env varaiables declaration.
 extern struct Env *envs;
@@ -79,6 +94,7 @@ i386_detect_memory (void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void kern_pgtables_freeze (void);
 static void check_page_free_list (bool only_low_memory);
 static void check_page_alloc (void);
 static void check_kern_pgdir (void);
@@ -190,6 +206,37 @@ get_kernpgdir ()
     return kern_pgdir;
 }
 
+//
+// Zero a physical page.
+// A page the kernel zeroes or copies is usually not touched again
+// until its new owner runs, so with SSE2 the stores bypass the cache
+// (movnti) instead of evicting the working set.
+//
+void
+page_zero (struct Page *pp)
+{
+    void *p = page2kva (pp);
+
+    if (use_nt (p, PGSIZE))
+        nt_fill64 (p, 0, PGSIZE / 64);
+    else
+        memset (p, 0, PGSIZE);
+}
+
+//
+// Copy physical page src to dst.
+//
+void
+page_copy (struct Page *dst, struct Page *src)
+{
+    void *d = page2kva (dst);
+
+    if (use_nt (d, PGSIZE))
+        nt_copy64 (d, page2kva (src), PGSIZE / 64);
+    else
+        memmove (d, page2kva (src), PGSIZE);
+}
+
 void
 mem_init (void)
 {
@@ -227,7 +274,15 @@ mem_init (void)
 
     // Your code goes here:
     pages = (struct Page *) boot_alloc (sizeof (struct Page) * npages);
-    envs = (struct Env *) boot_alloc (sizeof (struct Env) * NENV);
+    // As many Envs as a 1/ENV_TABLE_SHARE share of memory holds, up
+    // to NENV.  Nothing touches the table before kern_pgdir is loaded.
+    static_assert (NENV * sizeof (struct Env) <= UENVSIZE);
+    nenv = MIN ((size_t) NENV,
+                npages / ENV_TABLE_SHARE * PGSIZE / sizeof (struct Env));
+    envs = (struct Env *) boot_alloc (sizeof (struct Env) * nenv);
+    env_sched = (struct EnvSched *) boot_alloc (sizeof (struct EnvSched)
+                                                * nenv);
+    cprintf ("envs: %u of at most %u\n", nenv, NENV);
 
 
 
@@ -312,7 +367,8 @@ mem_init (void)
      */
     boot_map_region (kern_pgdir,
                      (uintptr_t) UENVS,
-                     NENV * sizeof (struct Env), PADDR (envs), PTE_U);
+                     ROUNDUP (nenv * sizeof (struct Env), PGSIZE),
+                     PADDR (envs), PTE_U);
     //kern_pgdir[PDX(UENVS)] &=(~PTE_W);
 
      // Initialize the SMP-related parts of the memory map
@@ -320,6 +376,10 @@ mem_init (void)
     // Check that the initial page directory has been set up correctly.
     check_kern_pgdir ();
 
+    // After this, kernel mappings only ever change inside page tables
+    // that all environments share.
+    kern_pgtables_freeze ();
+
 
 
     // Switch from the minimal entry page directory to the full kern_pgdir
@@ -329,7 +389,7 @@ mem_init (void)
     //
     // If the machine reboots at this point, you've probably set up your
     // kern_pgdir wrong.
-    lcr3 (PADDR (kern_pgdir));
+    pgdir_load (kern_pgdir);
 
     check_page_free_list (0);
 
@@ -383,6 +443,24 @@ mem_init_mp(void)
         }
 }
 
+//
+// Give every page directory slot above UTOP a page table, except UVPT,
+// which each page directory points at itself.  Kernel mappings added
+// later then go into tables all environments already share, and no
+// kernel PDE ever needs to be propagated to envs[].
+//
+static void
+kern_pgtables_freeze (void)
+{
+    uintptr_t va;
+
+    // va wraps around to 0 after the last slot.
+    for (va = UTOP; va != 0; va += PTSIZE)
+        if (PDX (va) != PDX (UVPT) && !(kern_pgdir[PDX (va)] & PTE_P))
+            assert (pgdir_walk (kern_pgdir, (void *) va, CREATE));
+    kern_pgtables_frozen = 1;
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct Page' entry per physical page.
@@ -518,6 +596,18 @@ page_alloc (int alloc_flags)
 {
     struct Page *ret_page = NIL;
 
+    // Pre-zeroed pages go to ALLOC_ZERO callers first, and to anyone
+    // once the free list runs dry.
+    if (page_zero_pool && ((ALLOC_ZERO & alloc_flags) || !page_free_list))
+    {
+        ret_page = page_zero_pool;
+        page_zero_pool = ret_page->pp_link;
+        page_zero_pool_n--;
+        ret_page->pp_link = NIL;
+        ret_page->pp_ref = 0;
+        return ret_page;
+    }
+
     if (NIL == page_free_list)
     {
         return NIL;
@@ -537,13 +627,33 @@ page_alloc (int alloc_flags)
         //It has the same result if here doesn't use KADDR(). But it needs to set following lines.
         // Map VA's [0, 4MB) to PA's [0, 4MB)
         //[0] = ((uintptr_t) entry_pgtable - KERNBASE) + PTE_P + PTE_W,
-        memset ((void *) KADDR (ret_page->paddr), '\0', PGSIZE);
-        //memset ((void *)  (ret_page->paddr), '\0', PGSIZE);
+        page_zero (ret_page);
     }
     ret_page->pp_ref = 0;
     return ret_page;
 }
 
+//
+// Move free pages into page_zero_pool, zeroing them, until it holds
+// PAGE_ZERO_POOL_MAX.  Run by idle CPUs.
+//
+void
+page_zero_pool_fill (void)
+{
+    struct Page *pp;
+
+    while (page_zero_pool_n < PAGE_ZERO_POOL_MAX && page_free_list)
+    {
+        pp = page_free_list;
+        page_free_list = pp->pp_link;
+        nAvailPages--;
+        page_zero (pp);
+        pp->pp_link = page_zero_pool;
+        page_zero_pool = pp;
+        page_zero_pool_n++;
+    }
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -616,6 +726,9 @@ pgdir_walk (pde_t * pgdir, const void *va, int create)
 //                cprintf ("PTE doesn't exist and NO_CREATE\n");
                 break;
             }
+            // Env page directories would never see this table.
+            if (kern_pgtables_frozen && (uintptr_t) va >= UTOP)
+                panic ("pgdir_walk: no kernel page table for %08x", va);
             if (NIL == (pde_pg = page_alloc (ALLOC_ZERO)))
             {
                 cprintf ("PTE doesn't exist and page_alloc failed\n");
@@ -705,6 +818,8 @@ boot_map_region (pde_t * pgdir, uintptr_t va, size_t size, physaddr_t pa,
          */
         if ((PTE_U & perm) && !(PTE_U & pgdir[PDX (va + i)]))
         {
+            // Env page directories hold their own copies of the PDE.
+            assert (!kern_pgtables_frozen);
             pgdir[PDX (va + i)] |= PTE_U;
         }
 
@@ -920,6 +1035,61 @@ page_remove (pde_t * pgdir, void *va)
 
 
 
+}
+
+//
+// Unmaps every page in [va, va + len), which must be page aligned and
+// lie below UTOP, and returns how many pages were mapped there.  Unlike
+// calling page_remove on each page, this walks each page table once,
+// frees page tables that end up empty, and flushes the TLB once.
+//
+int
+page_remove_range (pde_t * pgdir, void *va, size_t len)
+{
+    uintptr_t start = (uintptr_t) va, end = start + len, next;
+    struct Page *ptpage;
+    pte_t *pt;
+    int i, n, removed = 0, freed_pt = 0;
+
+    assert (!PGOFF (start) && !PGOFF (len));
+    assert (start <= end && end <= UTOP);
+
+    for (; start < end; start = next)
+    {
+        next = MIN (ROUNDDOWN (start, PTSIZE) + PTSIZE, end);
+        if (!(pgdir[PDX (start)] & PTE_P))
+            continue;
+
+        pt = (pte_t *) KADDR (PTE_ADDR (pgdir[PDX (start)]));
+        n = PTX (start) + (next - start) / PGSIZE;
+        for (i = PTX (start); i < n; i++)
+        {
+            if (pt[i] & PTE_P)
+            {
+                page_decref (pa2page (PTE_ADDR (pt[i])));
+                removed++;
+            }
+            pt[i] = 0;
+        }
+
+        // Free the page table once nothing is left in it.
+        for (i = 0; i < NPTENTRIES && !pt[i]; i++)
+            ;
+        // A lock-free pgdir_walk on another CPU may still be reading
+        // it, so it is only retired here; see kern/epoch.c.
+        if (i == NPTENTRIES)
+        {
+            ptpage = pa2page (PTE_ADDR (pgdir[PDX (start)]));
+            pgdir[PDX (start)] = 0;
+            if (--ptpage->pp_ref == 0)
+                epoch_retire_page (ptpage);
+            freed_pt = 1;
+        }
+    }
+
+    if (removed || freed_pt)
+        tlb_invalidate_range (pgdir, va, len);
+    return removed;
 }
 
 //
@@ -929,9 +1099,58 @@ page_remove (pde_t * pgdir, void *va)
 void
 tlb_invalidate (pde_t * pgdir, void *va)
 {
+	int i;
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (thiscpu->cpu_pgdir == pgdir)
 		invlpg(va);
+	// Other CPUs that still have it loaded reload it before they run
+	// user code in it again.
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_pgdir == pgdir)
+			cpus[i].cpu_tlb_stale = 1;
+}
+
+//
+// Invalidate the TLB entries for [va, va + len) in pgdir.  Past a few
+// pages it is cheaper to reload CR3 than to invlpg each one, and the
+// reload also drops any cached walks through freed page tables.
+//
+void
+tlb_invalidate_range (pde_t * pgdir, void *va, size_t len)
+{
+	uintptr_t a;
+	int i;
+
+	if (thiscpu->cpu_pgdir == pgdir) {
+		if (len > TLB_INVLPG_MAX * PGSIZE)
+			lcr3(PADDR(pgdir));
+		else
+			for (a = (uintptr_t) va; a < (uintptr_t) va + len; a += PGSIZE)
+				invlpg((void *) a);
+	}
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_pgdir == pgdir)
+			cpus[i].cpu_tlb_stale = 1;
+}
+
+//
+// Load pgdir into this CPU's CR3.  A CPU keeps the last user page
+// directory it loaded even while it idles, so it holds a reference
+// on that page to keep it from being freed and reused under it.
+//
+void
+pgdir_load (pde_t *pgdir)
+{
+	pde_t *old = thiscpu->cpu_pgdir;
+
+	if (pgdir != kern_pgdir)
+		pa2page (PADDR (pgdir))->pp_ref++;
+	thiscpu->cpu_pgdir = pgdir;
+	thiscpu->cpu_tlb_stale = 0;
+	lcr3 (PADDR (pgdir));
+	if (old && old != kern_pgdir)
+		page_decref (pa2page (PADDR (old)));
 }
 
 static uintptr_t user_mem_check_addr;
@@ -975,6 +1194,12 @@ user_mem_check (struct Env *env, const void *va, size_t len, int perm)
 
         pte_p = pgdir_walk (env->env_pgdir, (void *) va_cnt, NO_CREATE);
 
+        // The kernel is about to touch this on the env's behalf:
+        // map demand-zero pages now, as a user access would.
+        if ((NIL == pte_p || !(*pte_p & PTE_P))
+            && 0 == env_region_fault (env, va_cnt))
+            pte_p = pgdir_walk (env->env_pgdir, (void *) va_cnt, NO_CREATE);
+
         if (NIL == pte_p)
         {
             cprintf ("=== NIL ===\n");
@@ -1203,9 +1428,11 @@ check_kern_pgdir (void)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
 
 	// check envs array (new test for lab 3)
-	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
+	n = ROUNDUP(nenv*sizeof(struct Env), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
+	for (; i < UENVSIZE; i += PGSIZE)
+		assert(check_va2pa(pgdir, UENVS + i) == ~0);
 
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
@@ -1233,11 +1460,16 @@ check_kern_pgdir (void)
 		case PDX(UVPT):
 		case PDX(KSTACKTOP-1):
 		case PDX(UPAGES):
-		case PDX(UENVS):
 			assert(pgdir[i] & PTE_P);
 			break;
 		default:
-			if (i >= PDX(KERNBASE)) {
+			if (i >= PDX(UENVS) && i < PDX(UENVS + UENVSIZE)) {
+				// Page tables as far as the envs go.
+				if (i <= PDX(UENVS + nenv * sizeof(struct Env) - 1))
+					assert(pgdir[i] & PTE_P);
+				else
+					assert(pgdir[i] == 0);
+			} else if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
 				assert(pgdir[i] & PTE_W);
 			} else
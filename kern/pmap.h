@@ -70,17 +70,26 @@ enum
     ALLOC_ZERO = 1 << 0,
 };
 
+// Most pages page_zero_pool_fill keeps zeroed for ALLOC_ZERO.
+#define PAGE_ZERO_POOL_MAX 64
+
 void mem_init (void);
 
 void page_init (void);
 struct Page *page_alloc (int alloc_flags);
+void page_zero_pool_fill (void);
 void page_free (struct Page *pp);
+void page_zero (struct Page *pp);
+void page_copy (struct Page *dst, struct Page *src);
 int page_insert (pde_t * pgdir, struct Page *pp, void *va, int perm);
 void page_remove (pde_t * pgdir, void *va);
+int page_remove_range (pde_t * pgdir, void *va, size_t len);
 struct Page *page_lookup (pde_t * pgdir, void *va, pte_t ** pte_store);
 void page_decref (struct Page *pp);
 
 void tlb_invalidate (pde_t * pgdir, void *va);
+void tlb_invalidate_range (pde_t * pgdir, void *va, size_t len);
+void pgdir_load (pde_t * pgdir);
 
 int user_mem_check (struct Env *env, const void *va, size_t len, int perm);
 void user_mem_assert (struct Env *env, const void *va, size_t len, int perm);
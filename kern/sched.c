@@ -1,95 +1,700 @@
 #include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/x86.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/kclock.h>
+#include <kern/epoch.h>
 
+// CPUs halted in sched_halt, waiting for a wakeup IPI (bit i = CPU i).
+// Only changed with the kernel lock held.
+volatile uint32_t sched_idle_cpus;
+
+// May e be picked by this CPU at all?  Hard affinity: env_cpumask.
+static bool
+sched_allowed(struct Env *e)
+{
+	return (ENV_SCHED(e)->es_cpumask & (1 << cpunum())) != 0;
+}
+
+// Soft affinity.  An environment is left for the CPU it last ran on,
+// whose caches and TLB still hold its working set, unless that CPU is
+// already busy with another user environment or is no longer allowed
+// to run it.  An idle CPU will pick it up on its next pass.
+static bool
+sched_warm_here(struct Env *e)
+{
+	struct EnvSched *es = ENV_SCHED(e);
+	struct Env *other;
+
+	if (es->es_runs == 0 || es->es_cpunum == cpunum())
+		return 1;
+	if (!(es->es_cpumask & (1 << es->es_cpunum)))
+		return 1;
+	other = cpus[es->es_cpunum].cpu_env;
+	return other && other != e;
+}
+
+// The run queue holds the best-effort environments that are
+// ENV_RUNNABLE: one FIFO list per priority level and a bitmap of the
+// levels that are not empty, so finding the highest one is a single
+// bsf however many environments there are.  Running, blocked and EDF
+// environments are not on it.  Everything is O(1) but the walk along a
+// level past environments that may not run on this CPU.
+struct RunQueue {
+	uint32_t rq_bitmap;		// Bit p set if level p is not empty
+	struct Env *rq_head[SCHED_NPRIO];
+	struct Env *rq_tail[SCHED_NPRIO];
+};
+
+static struct RunQueue runq;
+
+static void
+rq_insert(struct RunQueue *rq, struct Env *e)
+{
+	int p = e->env_prio;
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail[p];
+	if (rq->rq_tail[p])
+		rq->rq_tail[p]->env_rq_next = e;
+	else
+		rq->rq_head[p] = e;
+	rq->rq_tail[p] = e;
+	rq->rq_bitmap |= 1U << p;
+	e->env_rq_queued = 1;
+}
+
+static void
+rq_remove(struct RunQueue *rq, struct Env *e)
+{
+	int p = e->env_prio;
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head[p] = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail[p] = e->env_rq_prev;
+	if (!rq->rq_head[p])
+		rq->rq_bitmap &= ~(1U << p);
+	e->env_rq_queued = 0;
+}
+
+// The first environment on the highest nonempty level, or NULL.
+static struct Env *
+rq_first(struct RunQueue *rq)
+{
+	if (!rq->rq_bitmap)
+		return NULL;
+	return rq->rq_head[__builtin_ctz(rq->rq_bitmap)];
+}
+
+// The next environment after e in priority order, or NULL.
+static struct Env *
+rq_next(struct RunQueue *rq, struct Env *e)
+{
+	uint32_t above;
+
+	if (e->env_rq_next)
+		return e->env_rq_next;
+	above = rq->rq_bitmap & ~((2U << e->env_prio) - 1);
+	return above ? rq->rq_head[__builtin_ctz(above)] : NULL;
+}
+
+// Put e at the tail of its level if it belongs on the run queue and
+// is not there yet.
+void
+sched_enqueue(struct Env *e)
+{
+	if (!e->env_rq_queued && e->env_status == ENV_RUNNABLE
+	    && !e->env_rt_period)
+		rq_insert(&runq, e);
+}
+
+// Take e off the run queue, if it is on it.
+void
+sched_dequeue(struct Env *e)
+{
+	if (e->env_rq_queued)
+		rq_remove(&runq, e);
+}
+
+void
+sched_set_prio(struct Env *e, int prio)
+{
+	bool queued = e->env_rq_queued;
+
+	sched_dequeue(e);
+	e->env_prio = prio;
+	if (queued)
+		sched_enqueue(e);
+}
+
+// Time picking the next environment, with the requeue that goes with
+// it, from a run queue of n environments spread over all levels.
+// Borrows free Env structures, so only the monitor may call this.
+// Returns cycles per pick, or 0 if there are not n free Envs.
+uint32_t
+sched_bench(int n)
+{
+	struct RunQueue rq;
+	struct Env *e;
+	uint64_t t0, t1;
+	int i, k;
+
+	memset(&rq, 0, sizeof(rq));
+	for (i = k = 0; i < nenv && k < n; i++)
+		if (envs[i].env_status == ENV_FREE) {
+			envs[i].env_prio = k++ % SCHED_NPRIO;
+			rq_insert(&rq, &envs[i]);
+		}
+	t0 = t1 = 0;
+	if (k == n) {
+		t0 = read_tsc();
+		for (i = 0; i < SCHED_BENCH_PICKS; i++) {
+			e = rq_first(&rq);
+			rq_remove(&rq, e);
+			rq_insert(&rq, e);
+		}
+		t1 = read_tsc();
+	}
+	while ((e = rq_first(&rq)))
+		rq_remove(&rq, e);
+	return (t1 - t0) / SCHED_BENCH_PICKS;
+}
+
+// Architectural performance monitoring: event select 0 and its counter.
+#define MSR_PERFEVTSEL0		0x186
+#define MSR_PMC0		0xc1
+#define PERFEVT_OS		(1 << 17)	// Count in ring 0
+#define PERFEVT_EN		(1 << 22)
+#define PERFEVT_LLC_MISSES	0x412e		// Umask 0x41, event 0x2e
+
+// Count LLC misses in PMC0, if the CPU has architectural performance
+// monitoring with that event.  Returns false if it does not.
+static bool
+sched_llc_start(void)
+{
+	uint32_t eax, ebx;
+
+	cpuid(0, &eax, NULL, NULL, NULL);
+	if (eax < 0xa)
+		return 0;
+	cpuid(0xa, &eax, &ebx, NULL, NULL);
+	// Version, at least one counter, LLC misses not marked missing.
+	if ((eax & 0xff) == 0 || ((eax >> 8) & 0xff) == 0
+	    || ((eax >> 24) & 0xff) <= 4 || (ebx & (1 << 4)))
+		return 0;
+	wrmsr(MSR_PERFEVTSEL0, 0);
+	wrmsr(MSR_PMC0, 0);
+	wrmsr(MSR_PERFEVTSEL0, PERFEVT_EN | PERFEVT_OS | PERFEVT_LLC_MISSES);
+	return 1;
+}
+
+static void
+sched_llc_stop(void)
+{
+	wrmsr(MSR_PERFEVTSEL0, 0);
+}
+
+// The two passes of sched_scan_bench, which time and count them.
+static uint32_t
+sched_scan_compact(uint32_t mask)
+{
+	struct EnvSched *es;
+	uint32_t n = 0;
+
+	for (es = env_sched; es < env_sched + nenv; es++)
+		if (es->es_status == ENV_RUNNABLE && (es->es_cpumask & mask)
+		    && (es->es_runs == 0 || es->es_cpunum == cpunum()))
+			n++;
+	return n;
+}
+
+static uint32_t
+sched_scan_full(uint32_t mask)
+{
+	struct Env *e;
+	uint32_t n = 0;
+
+	for (e = envs; e < envs + nenv; e++)
+		if (e->env_status == ENV_RUNNABLE && (e->env_cpumask & mask)
+		    && (e->env_runs == 0 || e->env_cpunum == cpunum()))
+			n++;
+	return n;
+}
+
+// Time a pass that reads what a pick reads of every environment
+// (status, affinity, last CPU and run count), once over env_sched[]
+// and once over the same fields in the full-size Envs of envs[].  The
+// caches are written back and emptied before each pass, so it pays
+// for every line it touches.  Stores cycles per env for each, and LLC
+// misses per thousand envs, or ~0 if the CPU cannot count them.
+void
+sched_scan_bench(struct SchedScan *compact, struct SchedScan *full)
+{
+	struct SchedScan *r;
+	uint32_t mask = 1 << cpunum(), n;
+	uint64_t t0, t1;
+	bool llc;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		r = pass ? full : compact;
+		asm volatile("wbinvd" : : : "memory");
+		llc = sched_llc_start();
+		t0 = read_tsc();
+		n = pass ? sched_scan_full(mask) : sched_scan_compact(mask);
+		t1 = read_tsc();
+		r->ss_misses = llc ? rdpmc(0) * 1000 / nenv : ~0U;
+		if (llc)
+			sched_llc_stop();
+		// Keep the pass from being thrown away.
+		asm volatile("" : : "r" (n));
+		r->ss_cycles = (t1 - t0) / nenv;
+	}
+}
+
+// e, an EDF environment, just became runnable and its CPU is busy.
+// EDF runs ahead of best effort, so if that CPU runs a best-effort
+// environment, have it reschedule now instead of at the end of the
+// slice, which may be as long as SCHED_QUANTUM_MAX_US.
+static void
+sched_rt_preempt(struct Env *e)
+{
+	int cpu = e->env_rt_cpu;
+	struct Env *cur = cpus[cpu].cpu_env;
+
+	if (!cur || cur->env_status != ENV_RUNNING || cur->env_rt_period)
+		return;
+	if (cpu == cpunum())
+		// A tick as soon as we are back in user mode.
+		lapic_timer_arm(1);
+	else
+		lapic_ipi_cpu(cpus[cpu].cpu_id, T_IPI_RESCHED);
+}
+
+// e just became runnable.  If a halted CPU may run it, wake one up:
+// the CPU e last ran on if that one is halted, so e finds its cache
+// warm, otherwise the lowest-numbered halted CPU in e's mask.
+static void
+sched_kick(struct Env *e)
+{
+	uint32_t mask = e->env_rt_period ? 1 << e->env_rt_cpu : e->env_cpumask;
+	uint32_t idle = sched_idle_cpus & mask;
+	int cpu;
+
+	if (!idle) {
+		if (e->env_rt_period)
+			sched_rt_preempt(e);
+		return;
+	}
+	if (idle & (1 << e->env_cpunum))
+		cpu = e->env_cpunum;
+	else
+		cpu = __builtin_ctz(idle);
+	// Clear the bit now so later kicks pick a different CPU.
+	sched_idle_cpus &= ~(1 << cpu);
+	lapic_ipi_cpu(cpus[cpu].cpu_id, T_IPI_WAKEUP);
+}
+
+// e just became runnable: queue it and get a CPU going for it.
+void
+sched_wakeup(struct Env *e)
+{
+	sched_enqueue(e);
+	sched_kick(e);
+}
+
+// This CPU is about to run 'picked'.  If another environment is left
+// waiting while some CPU is halted, wake a CPU for it.
+static void
+sched_balance(struct Env *picked)
+{
+	struct Env *e;
+
+	if (!sched_idle_cpus)
+		return;
+	for (e = rq_first(&runq); e; e = rq_next(&runq, e))
+		if (e != picked && (e->env_cpumask & sched_idle_cpus)) {
+			sched_kick(e);
+			return;
+		}
+}
+
+// Gang scheduling.  The members of a gang (same nonzero env_gang) are
+// parts of one parallel job and should run at the same time, or they
+// waste their slices spinning on each other.  When the scan picks a
+// member, this CPU hands the other runnable members to other CPUs and
+// starts their slice with one broadcast T_IPI_GANG; the CPUs that were
+// given a member preempt whatever they run for it.
+
+static int sched_ngangs;
+
+int
+sched_gang_create(void)
+{
+	return ++sched_ngangs;
+}
+
+bool
+sched_gang_exists(int gang)
+{
+	return gang > 0 && gang <= sched_ngangs;
+}
+
+// May CPU c be given a gang member?  Not if it was given one already,
+// nor if it runs a member of any gang: that gang's slot runs to its
+// end, or two gangs would keep evicting each other.
+static bool
+sched_gang_cpu_free(int c)
+{
+	struct Env *e = cpus[c].cpu_env;
+
+	if (c == cpunum() || cpus[c].cpu_status == CPU_UNUSED
+	    || cpus[c].cpu_gang_next)
+		return 0;
+	return !(e && e->env_status == ENV_RUNNING && e->env_gang);
+}
+
+// This CPU is about to run 'picked'.  Co-schedule the rest of its gang.
+static void
+sched_gang_start(struct Env *picked)
+{
+	struct Env *e;
+	bool sent = 0;
+	int c;
+
+	if (!picked->env_gang)
+		return;
+	// Runnable members are all on the run queue.
+	for (e = rq_first(&runq); e; e = rq_next(&runq, e)) {
+		if (e == picked || e->env_gang != picked->env_gang)
+			continue;
+		for (c = 0; c < ncpu; c++)
+			if ((e->env_cpumask & (1 << c))
+			    && sched_gang_cpu_free(c))
+				break;
+		if (c == ncpu)
+			continue;
+		cpus[c].cpu_gang_next = e;
+		sent = 1;
+	}
+	if (sent)
+		lapic_ipi(T_IPI_GANG);
+}
+
+// Earliest-deadline-first class.  An environment with a (period,
+// budget) reservation is admitted to one CPU only while the total
+// budget/period admitted there stays within SCHED_RT_UTIL_MAX, which
+// is what EDF needs to meet every deadline.  On that CPU it runs ahead
+// of all best-effort environments, earliest deadline first, until it
+// has used its budget for the period; the LAPIC timer enforces that.
+// Giving up the CPU with sys_yield ends its job for the period.
+
+static uint32_t
+sched_rt_util(uint32_t period, uint32_t budget)
+{
+	return ((uint64_t) budget * SCHED_RT_UTIL_SCALE + period - 1) / period;
+}
+
+// Give e the reservation (period, budget) in microseconds, or make it
+// best effort if period is 0.  Returns -E_INVAL, leaving e best effort,
+// if the parameters make no sense or no CPU e may use has the room.
+int
+sched_rt_admit(struct Env *e, uint32_t period, uint32_t budget)
+{
+	uint32_t util;
+	int c, best = -1;
+
+	sched_rt_release(e);
+	if (period == 0)
+		return 0;
+	if (budget == 0 || budget > period)
+		return -E_INVAL;
+
+	// The least loaded CPU that has room.
+	util = sched_rt_util(period, budget);
+	for (c = 0; c < ncpu; c++)
+		if ((e->env_cpumask & (1 << c))
+		    && cpus[c].cpu_rt_util + util <= SCHED_RT_UTIL_MAX
+		    && (best < 0 || cpus[c].cpu_rt_util < cpus[best].cpu_rt_util))
+			best = c;
+	if (best < 0)
+		return -E_INVAL;
+
+	cpus[best].cpu_rt_util += util;
+	e->env_rt_next = cpus[best].cpu_rt_list;
+	cpus[best].cpu_rt_list = e;
+	e->env_rt_period = period;
+	e->env_rt_budget = budget;
+	e->env_rt_cpu = best;
+	e->env_rt_deadline = time_ns() + (uint64_t) period * 1000;
+	e->env_rt_used = 0;
+	e->env_rt_done = 0;
+	sched_dequeue(e);
+	return 0;
+}
+
+// Drop e's reservation, if it has one.
+void
+sched_rt_release(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_rt_period)
+		return;
+	for (pp = &cpus[e->env_rt_cpu].cpu_rt_list; *pp != e;
+	     pp = &(*pp)->env_rt_next)
+		;
+	*pp = e->env_rt_next;
+	cpus[e->env_rt_cpu].cpu_rt_util -=
+		sched_rt_util(e->env_rt_period, e->env_rt_budget);
+	e->env_rt_period = 0;
+	sched_enqueue(e);
+}
+
+// Charge the EDF environment that ran in this CPU's last slice.
+static void
+sched_rt_charge(void)
+{
+	struct Env *e = thiscpu->cpu_rt_env;
+
+	if (!e)
+		return;
+	thiscpu->cpu_rt_env = NULL;
+	e->env_rt_used += time_ns() - thiscpu->cpu_rt_start;
+}
+
+// Start the periods of this CPU's EDF environments that are due, and
+// return the one to run now: the earliest deadline among those with
+// budget left.  Also note when the next waiting one is released.
+static struct Env *
+sched_rt_pick(void)
+{
+	struct Env *e, *best = NULL;
+	uint64_t now, period;
+
+	thiscpu->cpu_rt_next = 0;
+	if (!thiscpu->cpu_rt_list)
+		return NULL;
+
+	now = time_ns();
+	for (e = thiscpu->cpu_rt_list; e; e = e->env_rt_next) {
+		if (now >= e->env_rt_deadline) {
+			period = (uint64_t) e->env_rt_period * 1000;
+			if (!e->env_rt_done
+			    && e->env_rt_used < (uint64_t) e->env_rt_budget * 1000
+			    && (e->env_status == ENV_RUNNABLE
+				|| e->env_status == ENV_RUNNING))
+				e->env_rt_misses++;
+			e->env_rt_deadline +=
+				((now - e->env_rt_deadline) / period + 1) * period;
+			e->env_rt_used = 0;
+			e->env_rt_done = 0;
+		}
+		if (e->env_rt_done
+		    || e->env_rt_used >= (uint64_t) e->env_rt_budget * 1000) {
+			if (!thiscpu->cpu_rt_next
+			    || e->env_rt_deadline < thiscpu->cpu_rt_next)
+				thiscpu->cpu_rt_next = e->env_rt_deadline;
+			continue;
+		}
+		if ((e->env_status == ENV_RUNNABLE
+		     || (e == curenv && e->env_status == ENV_RUNNING))
+		    && sched_allowed(e)
+		    && (!best || e->env_rt_deadline < best->env_rt_deadline))
+			best = e;
+	}
+	return best;
+}
+
+// Shorten a slice of 'us' microseconds so this CPU reschedules when the
+// next EDF environment is released.
+static uint32_t
+sched_rt_cap(uint32_t us)
+{
+	uint64_t now, next = thiscpu->cpu_rt_next;
+
+	if (!next)
+		return us;
+	now = time_ns();
+	if (next <= now)
+		return 1;
+	if ((next - now) / 1000 + 1 < us)
+		us = (next - now) / 1000 + 1;
+	return us;
+}
+
+// The idle loop.  Stop the timer (unless env_reclaim has work left)
+// and halt until an interrupt arrives, normally the IPI sent by
+// sched_kick.  The CPU gives up the kernel lock and sleeps on the top
+// of its kernel stack with interrupts on; trap() takes the lock back
+// and the handler reschedules.  CR3 is left alone, so going back to
+// the same env costs no reload.
+static void __attribute__((noreturn))
+sched_halt(void)
+{
+	// Nothing may resume whatever this CPU was running last,
+	// and it may go on elsewhere, FPU state included.
+	fpu_save();
+	env_drop_refs();
+	curenv = NULL;
+	page_zero_pool_fill();
+	// With address spaces left to reclaim, do a chunk now and come
+	// back on a short timer for the next, giving up the lock between.
+	// The same goes for retired objects other CPUs still hold up.
+	// Come back for the next EDF release too.
+	if (env_reclaim(ENV_RECLAIM_BATCH) | epoch_collect())
+		lapic_timer_arm(sched_rt_cap(SCHED_RECLAIM_US));
+	else if (thiscpu->cpu_rt_next)
+		lapic_timer_arm(sched_rt_cap(~0));
+	else
+		lapic_timer_stop();
+	sched_idle_cpus |= 1 << cpunum();
+	epoch_exit();
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	unlock_kernel();
+
+	// Reset the stack pointer, enable interrupts and then halt.
+	// sti only takes effect after the next instruction, so an IPI
+	// sent since the unlock still wakes us out of the hlt.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"1:\n"
+		"sti\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("sched_halt: woke up");
+}
+
+// Run e for one timeslice.  Only a scheduling decision starts a new
+// slice; returning to the same env after a trap keeps the current one.
+// An EDF environment's slice is what is left of its budget.
+static void __attribute__((noreturn))
+sched_run(struct Env *e)
+{
+	uint32_t us = e->env_quantum ? e->env_quantum : SCHED_QUANTUM_US;
+
+	if (e->env_rt_period) {
+		us = ((uint64_t) e->env_rt_budget * 1000 - e->env_rt_used
+		      + 999) / 1000;
+		thiscpu->cpu_rt_env = e;
+		thiscpu->cpu_rt_start = time_ns();
+	}
+	lapic_timer_arm(sched_rt_cap(us));
+	env_run(e);
+}
+
+// Directed yield: run e on this CPU at once, without scanning, for what
+// is left of the current timeslice.  Returns -E_INVAL, without
+// switching, unless e is runnable and allowed here.  EDF environments
+// take no part: the slice of one is its budget, which e would run on
+// and be charged to, at EDF priority.
+int
+sched_yield_to(struct Env *e)
+{
+	if (e == curenv || e->env_status != ENV_RUNNABLE || !sched_allowed(e)
+	    || e->env_rt_period || curenv->env_rt_period)
+		return -E_INVAL;
+	curenv->env_vswitches++;
+	env_run(e);
+}
+
+// Is any environment runnable, or running on some CPU?  Everything
+// that is sits on the run queue, a CPU or an EDF list.
+static bool
+sched_any_runnable(void)
+{
+	struct Env *e;
+	int c;
+
+	if (rq_first(&runq))
+		return 1;
+	for (c = 0; c < ncpu; c++) {
+		if ((e = cpus[c].cpu_env) && e->env_status == ENV_RUNNING)
+			return 1;
+		for (e = cpus[c].cpu_rt_list; e; e = e->env_rt_next)
+			if (e->env_status == ENV_RUNNABLE
+			    || e->env_status == ENV_RUNNING)
+				return 1;
+	}
+	return 0;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
-	int i = -1,cnt;
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
+	// Run the first environment on the run queue, in priority
+	// order, that may run on this CPU.  The environment this CPU was
+	// running goes to the tail of its level first, so it runs again
+	// only if nothing else at its level is ready: round robin within
+	// a level.  If there is nothing to run, drop through to the code
+	// below to halt this CPU.
 	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING) and never choose an
-	// idle environment (env_type == ENV_TYPE_IDLE).  If there are
-	// no runnable environments, simply drop through to the code
-	// below to switch to this CPU's idle environment.
+	// Skip environments whose affinity mask excludes this CPU, and
+	// ones that would rather wait for the CPU they last ran on.
 
 	// LAB 4: Your code here.
 
-        if(0 == thiscpu->cpu_env)
+        // EDF environments first.
+        sched_rt_charge();
+        if((e = sched_rt_pick()))
+            sched_run(e);
+
+        // Another CPU started this gang member's slice.
+        if(thiscpu->cpu_gang_next)
         {
-            i = 0;
-        }
-        else if(thiscpu->cpu_env->env_status == ENV_RUNNING)
-        { /*Note: It might check for future needed state*/
-            thiscpu->cpu_env->env_status = ENV_RUNNABLE;
-            i = (curenv - envs) + 1;//bug_019
+            e = thiscpu->cpu_gang_next;
+            thiscpu->cpu_gang_next = NULL;
+            if(e->env_status == ENV_RUNNABLE && sched_allowed(e))
+                sched_run(e);
         }
 
-        if(i == -1)
+        if(thiscpu->cpu_env && thiscpu->cpu_env->env_status == ENV_RUNNING)
         {
-           i = thiscpu->cpu_env - envs;
+            env_set_status(thiscpu->cpu_env, ENV_RUNNABLE);
+            sched_enqueue(thiscpu->cpu_env);
         }
-        
-	for ( cnt = 0 ;cnt < NENV ;i++, cnt++) 
+
+        for(e = rq_first(&runq); e; e = rq_next(&runq, e))
         {
-            if(i >= NENV)
-                i = i % NENV;
-            if(envs[i].env_type != ENV_TYPE_IDLE && envs[i].env_status == ENV_RUNNABLE)
+            if(sched_allowed(e) && sched_warm_here(e))
             {
                 /*env_run will do 
                  * 1: set thiscpu's cpu_env to the passed env. 
                  * 2: set env's state to ENV_RUNNING
+                 *    and take it off the run queue
                  * */
-                env_run(&envs[i]);
-                break;
+                sched_balance(e);
+                sched_gang_start(e);
+                sched_run(e);
             }
         }
 
 	// For debugging and testing purposes, if there are no
-	// runnable environments other than the idle environments,
-	// drop into the kernel monitor.
+	// runnable environments at all, drop into the kernel monitor.
 #ifdef TESTING_GRADE_PURPOSE
-	for (i = 0; i < NENV; i++) {
-		if (envs[i].env_type != ENV_TYPE_IDLE &&
-		    (envs[i].env_status == ENV_RUNNABLE ||
-                     envs[i].env_status == ENV_RUNNING))
-                {
-//                    cprintf("===env %d is the GUY===\n",i); //Debug
-                    break;
-                }
-	}
-	if (i == NENV) {
+	if (!sched_any_runnable()) {
 		cprintf("No more runnable environments!\n");
 		while (1) monitor(NULL);
 	}
 #endif
 
-        // Run this CPU's idle environment when nothing else is runnable.'
-        if(cnt == NENV)
-        {
-            idle = &envs[cpunum()];
-            if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
-                panic("CPU %d: No idle environment!", cpunum());
-            env_run(idle);
-            //Compare it to co-routine scheduler in xv6
-            //It is never returned here.
-            cprintf("CPU %d is back\n",cpunum());
-        }
-
-
+        // Nothing to run: idle in the kernel until there is work.
+        sched_halt();
 }
@@ -6,7 +6,44 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+// Timeslice given to an environment with no env_quantum of its own.
+#define SCHED_QUANTUM_US	10000
+#define SCHED_QUANTUM_MAX_US	1000000
+// Run queue priority levels; 0 is the highest.
+#define SCHED_NPRIO		32
+#define SCHED_PRIO_DEFAULT	16
+// Picks timed per run by sched_bench.
+#define SCHED_BENCH_PICKS	100000
+// EDF utilization (budget/period) admitted per CPU is kept at or under
+// SCHED_RT_UTIL_MAX / SCHED_RT_UTIL_SCALE, leaving the rest for
+// best-effort environments.
+#define SCHED_RT_UTIL_SCALE	1000
+#define SCHED_RT_UTIL_MAX	900
+// How soon an idle CPU comes back for more env_reclaim work.
+#define SCHED_RECLAIM_US	100
+
+#include <inc/types.h>
+
+struct Env;
+
+extern volatile uint32_t sched_idle_cpus;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+int sched_yield_to(struct Env *e);
+int sched_gang_create(void);
+bool sched_gang_exists(int gang);
+int sched_rt_admit(struct Env *e, uint32_t period, uint32_t budget);
+void sched_rt_release(struct Env *e);
+void sched_wakeup(struct Env *e);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+void sched_set_prio(struct Env *e, int prio);
+uint32_t sched_bench(int n);
+struct SchedScan {
+	uint32_t ss_cycles;		// Per env
+	uint32_t ss_misses;		// LLC misses per 1000 envs, ~0 if unknown
+};
+void sched_scan_bench(struct SchedScan *compact, struct SchedScan *full);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,322 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// Each cache hands out objects of one size, carved from slabs of one
+// page got from page_alloc.  A slab starts with a header and a stack of
+// the indices of its free objects, then the objects themselves.  Free
+// objects are never written, so an object set up by the cache's
+// constructor when its slab was made keeps that state from one use to
+// the next: callers must give objects back the way the constructor
+// left them.
+//
+// Successive slabs start their objects at different offsets (colors)
+// inside the page, SLAB_COLOR_ALIGN apart, using up the space the
+// objects leave over.
+//
+// Each CPU keeps up to SLAB_CPU_NOBJS free objects per cache, so most
+// allocations and frees take no lock; the CPU refills or drains its
+// stash SLAB_CPU_BATCH objects at a time under sc_lock.  The kernel
+// runs with interrupts off, so nothing else touches a CPU's stash.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/slab.h>
+#include <kern/pmap.h>
+
+struct Slab {
+	struct Slab *sl_next;		// On sc_partial
+	struct Slab *sl_prev;
+	struct SlabCache *sl_cache;
+	char *sl_objs;			// First object
+	uint32_t sl_nfree;		// Entries in sl_free
+	uint8_t sl_free[];		// Indices of the free objects
+};
+
+struct SlabCache slab_caches[SLAB_NCACHES];
+int slab_ncaches;
+
+// Make a cache of objects of 'size' bytes aligned to 'align', a power
+// of two no bigger than SLAB_COLOR_ALIGN.  ctor, if not NULL, is run on
+// every object when the slab holding it is made.
+struct SlabCache *
+slab_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct SlabCache *sc;
+	uint32_t n, left;
+
+	assert(align && !(align & (align - 1)) && align <= SLAB_COLOR_ALIGN);
+	size = ROUNDUP(MAX(size, SLAB_MIN_SIZE), align);
+	assert(size <= SLAB_MAX_SIZE);
+	if (slab_ncaches == SLAB_NCACHES)
+		panic("slab_cache_create: too many caches");
+
+	sc = &slab_caches[slab_ncaches++];
+	memset(sc, 0, sizeof(*sc));
+	sc->sc_name = name;
+	sc->sc_size = size;
+	sc->sc_align = align;
+	sc->sc_ctor = ctor;
+	// As many objects as fit after the header and their indices.
+	for (n = PGSIZE / size; ; n--) {
+		sc->sc_offset = ROUNDUP(sizeof(struct Slab) + n, align);
+		if (sc->sc_offset + n * size <= PGSIZE)
+			break;
+	}
+	static_assert(PGSIZE / SLAB_MIN_SIZE <= 256);
+	sc->sc_perslab = n;
+	left = PGSIZE - sc->sc_offset - n * size;
+	sc->sc_ncolors = left / SLAB_COLOR_ALIGN + 1;
+	spin_initlock(&sc->sc_lock);
+	return sc;
+}
+
+static void
+slab_link(struct SlabCache *sc, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = sc->sc_partial;
+	if (sc->sc_partial)
+		sc->sc_partial->sl_prev = sl;
+	sc->sc_partial = sl;
+}
+
+static void
+slab_unlink(struct SlabCache *sc, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		sc->sc_partial = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+}
+
+// Add a fresh slab to sc.  Called with sc_lock held.
+static int
+slab_grow(struct SlabCache *sc)
+{
+	struct Page *pp;
+	struct Slab *sl;
+	uint32_t i;
+
+	if (!(pp = page_alloc(0)))
+		return -1;
+	pp->pp_ref++;
+	sl = page2kva(pp);
+	sl->sl_cache = sc;
+	sl->sl_objs = (char *) sl + sc->sc_offset
+		+ sc->sc_color * SLAB_COLOR_ALIGN;
+	sc->sc_color = (sc->sc_color + 1) % sc->sc_ncolors;
+	sl->sl_nfree = sc->sc_perslab;
+	for (i = 0; i < sc->sc_perslab; i++) {
+		// Hand out the lowest addresses first.
+		sl->sl_free[i] = sc->sc_perslab - 1 - i;
+		if (sc->sc_ctor)
+			sc->sc_ctor(sl->sl_objs + i * sc->sc_size);
+	}
+	slab_link(sc, sl);
+	sc->sc_nslabs++;
+	sc->sc_nempty++;
+	return 0;
+}
+
+// Take up to n objects from the slabs into objs.  Returns how many.
+static int
+slab_take(struct SlabCache *sc, void **objs, int n)
+{
+	struct Slab *sl;
+	int got = 0;
+
+	spin_lock(&sc->sc_lock);
+	while (got < n) {
+		if (!sc->sc_partial && slab_grow(sc) < 0)
+			break;
+		sl = sc->sc_partial;
+		if (sl->sl_nfree == sc->sc_perslab)
+			sc->sc_nempty--;
+		objs[got++] = sl->sl_objs
+			+ sl->sl_free[--sl->sl_nfree] * sc->sc_size;
+		if (!sl->sl_nfree)
+			slab_unlink(sc, sl);
+	}
+	sc->sc_inuse += got;
+	spin_unlock(&sc->sc_lock);
+	return got;
+}
+
+// Give n objects back to their slabs.  Slabs left with nothing in use
+// go back to page_free, but for one kept for the next allocation.
+static void
+slab_give(struct SlabCache *sc, void **objs, int n)
+{
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	spin_lock(&sc->sc_lock);
+	for (i = 0; i < n; i++) {
+		obj = objs[i];
+		sl = (struct Slab *) ROUNDDOWN(obj, PGSIZE);
+		assert(sl->sl_cache == sc);
+		if (!sl->sl_nfree)
+			slab_link(sc, sl);
+		sl->sl_free[sl->sl_nfree++] = (obj - sl->sl_objs) / sc->sc_size;
+		if (sl->sl_nfree < sc->sc_perslab)
+			continue;
+		if (sc->sc_nempty) {
+			slab_unlink(sc, sl);
+			sc->sc_nslabs--;
+			page_decref(pa2page(PADDR(sl)));
+		} else
+			sc->sc_nempty++;
+	}
+	sc->sc_inuse -= n;
+	spin_unlock(&sc->sc_lock);
+}
+
+// Returns NULL if out of memory.
+void *
+slab_alloc(struct SlabCache *sc)
+{
+	struct SlabCpu *c = &sc->sc_cpu[cpunum()];
+
+	if (!c->scpu_n)
+		c->scpu_n = slab_take(sc, c->scpu_objs, SLAB_CPU_BATCH);
+	if (!c->scpu_n)
+		return NULL;
+	return c->scpu_objs[--c->scpu_n];
+}
+
+void
+slab_free(struct SlabCache *sc, void *obj)
+{
+	struct SlabCpu *c = &sc->sc_cpu[cpunum()];
+
+	if (c->scpu_n == SLAB_CPU_NOBJS) {
+		c->scpu_n -= SLAB_CPU_BATCH;
+		slab_give(sc, c->scpu_objs + c->scpu_n, SLAB_CPU_BATCH);
+	}
+	c->scpu_objs[c->scpu_n++] = obj;
+}
+
+// Free objects sitting in the CPUs' stashes.
+uint32_t
+slab_cpu_cached(struct SlabCache *sc)
+{
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		n += sc->sc_cpu[i].scpu_n;
+	return n;
+}
+
+// Check the slab allocator on a cache of its own, dropped afterwards.
+
+#define CHECK_SLAB_SIZE		120	// Leaves room for two colors
+#define CHECK_SLAB_MAGIC	0x51AB51AB
+
+static void
+check_slab_ctor(void *obj)
+{
+	uint32_t *w = obj;
+	int i;
+
+	for (i = 0; i < CHECK_SLAB_SIZE / 4; i++)
+		w[i] = CHECK_SLAB_MAGIC;
+}
+
+static bool
+check_slab_constructed(void *obj)
+{
+	uint32_t *w = obj;
+	int i;
+
+	for (i = 0; i < CHECK_SLAB_SIZE / 4; i++)
+		if (w[i] != CHECK_SLAB_MAGIC)
+			return 0;
+	return 1;
+}
+
+void
+check_slab(void)
+{
+	struct SlabCache *sc;
+	struct SlabCpu *c;
+	struct Slab *sl;
+	void *objs[2 * PGSIZE / CHECK_SLAB_SIZE + 1];
+	int i, j, n;
+
+	sc = slab_cache_create("check", CHECK_SLAB_SIZE, 8, check_slab_ctor);
+	c = &sc->sc_cpu[cpunum()];
+	assert(sc->sc_size == CHECK_SLAB_SIZE && sc->sc_ncolors > 1);
+	assert(sc->sc_nslabs == 0 && sc->sc_inuse == 0);
+
+	// The first allocation takes a batch; the rest of it waits in
+	// this CPU's stash.
+	assert((objs[0] = slab_alloc(sc)));
+	assert(sc->sc_nslabs == 1 && sc->sc_inuse == SLAB_CPU_BATCH);
+	assert(c->scpu_n == SLAB_CPU_BATCH - 1);
+	for (i = 1; i < SLAB_CPU_BATCH; i++)
+		assert((objs[i] = slab_alloc(sc)));
+	assert(c->scpu_n == 0 && sc->sc_inuse == SLAB_CPU_BATCH);
+	assert((objs[i] = slab_alloc(sc)));
+	assert(sc->sc_inuse == 2 * SLAB_CPU_BATCH);
+
+	// Fill two slabs and start a third.
+	n = 2 * sc->sc_perslab + 1;
+	assert(n <= sizeof(objs) / sizeof(objs[0]));
+	for (i++; i < n; i++)
+		assert((objs[i] = slab_alloc(sc)));
+	assert(sc->sc_nslabs == 3);
+	for (i = 0; i < n; i++) {
+		// Distinct, aligned, constructed, and inside a slab of sc.
+		assert((uintptr_t) objs[i] % 8 == 0);
+		assert(check_slab_constructed(objs[i]));
+		sl = ROUNDDOWN((struct Slab *) objs[i], PGSIZE);
+		assert(sl->sl_cache == sc);
+		assert((char *) objs[i] >= sl->sl_objs
+		       && (char *) objs[i] + CHECK_SLAB_SIZE
+		       <= (char *) sl + PGSIZE);
+		for (j = 0; j < i; j++)
+			assert(objs[j] != objs[i]);
+	}
+	// Successive slabs are colored differently.
+	assert(PGOFF(objs[0]) != PGOFF(objs[sc->sc_perslab]));
+
+	// Freeing fills the stash; one more drains a batch from it.
+	for (i = 0; i < SLAB_CPU_NOBJS; i++)
+		slab_free(sc, objs[n - 1 - i]);
+	assert(c->scpu_n == SLAB_CPU_NOBJS);
+	j = sc->sc_inuse;
+	slab_free(sc, objs[n - 1 - i]);
+	assert(c->scpu_n == SLAB_CPU_NOBJS - SLAB_CPU_BATCH + 1);
+	assert(sc->sc_inuse == j - SLAB_CPU_BATCH);
+
+	// Free everything and drain the stash: all but one of the slabs,
+	// now empty, go back to the page allocator.
+	for (i++; i < n; i++)
+		slab_free(sc, objs[n - 1 - i]);
+	slab_give(sc, c->scpu_objs, c->scpu_n);
+	c->scpu_n = 0;
+	assert(sc->sc_inuse == 0);
+	assert(sc->sc_nslabs == 1 && sc->sc_nempty == 1);
+
+	// Objects come back as the constructor left them.
+	assert((objs[0] = slab_alloc(sc)));
+	assert(check_slab_constructed(objs[0]));
+	assert(sc->sc_nslabs == 1);
+	slab_free(sc, objs[0]);
+
+	// Drop the cache, the last one made.
+	slab_give(sc, c->scpu_objs, c->scpu_n);
+	c->scpu_n = 0;
+	sl = sc->sc_partial;
+	assert(sl && !sl->sl_next && sl->sl_nfree == sc->sc_perslab);
+	page_decref(pa2page(PADDR(sl)));
+	assert(sc == &slab_caches[slab_ncaches - 1]);
+	slab_ncaches--;
+
+	cprintf("check_slab() succeeded!\n");
+}
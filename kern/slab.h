@@ -0,0 +1,63 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Caches there can be at most
+#define SLAB_NCACHES		16
+// Objects may be at most this big and at least this small
+#define SLAB_MAX_SIZE		(PGSIZE / 4)
+#define SLAB_MIN_SIZE		16
+// Slabs start their objects at one of several offsets this far apart
+// (cache coloring), so objects of different slabs spread over cache
+// lines instead of all landing on the same few sets.
+#define SLAB_COLOR_ALIGN	64
+// Objects each CPU keeps per cache, and how many it moves at a time
+#define SLAB_CPU_NOBJS		8
+#define SLAB_CPU_BATCH		4
+
+struct Slab;
+
+// Objects a CPU can hand out and take back without sc_lock.
+struct SlabCpu {
+	void *scpu_objs[SLAB_CPU_NOBJS];
+	int scpu_n;
+};
+
+struct SlabCache {
+	const char *sc_name;
+	size_t sc_size;			// Object size, a multiple of sc_align
+	size_t sc_align;
+	void (*sc_ctor)(void *);	// Sets up a new object, or NULL
+	uint32_t sc_perslab;		// Objects per slab
+	uint32_t sc_offset;		// Of the first object, before coloring
+	uint32_t sc_ncolors;		// Offsets slabs cycle through
+	uint32_t sc_color;		// ... and the next one to use
+
+	struct spinlock sc_lock;	// Protects the rest
+	struct Slab *sc_partial;	// Slabs with free objects
+	uint32_t sc_nslabs;
+	uint32_t sc_nempty;		// Slabs with no object in use
+	uint32_t sc_inuse;		// Objects handed out, CPU caches included
+
+	struct SlabCpu sc_cpu[NCPU];
+};
+
+extern struct SlabCache slab_caches[];
+extern int slab_ncaches;
+
+struct SlabCache *slab_cache_create(const char *name, size_t size,
+				    size_t align, void (*ctor)(void *));
+void *slab_alloc(struct SlabCache *sc);
+void slab_free(struct SlabCache *sc, void *obj);
+uint32_t slab_cpu_cached(struct SlabCache *sc);
+void check_slab(void);
+
+#endif	// !JOS_KERN_SLAB_H
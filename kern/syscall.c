@@ -11,6 +11,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/kclock.h>
+#include <kern/fpu.h>
 #include <kern/env.h>
 
 // Print a string to the system console.
@@ -68,9 +70,32 @@ sys_env_destroy (envid_t envid)
 static void
 sys_yield(void)
 {
+	curenv->env_vswitches++;
+	// An EDF job that gives up the CPU is done until its next period.
+	if (curenv->env_rt_period)
+		curenv->env_rt_done = 1;
 	sched_yield();
 }
 
+// Give the rest of the caller's timeslice to 'envid', which runs on
+// this CPU at once, bypassing the scheduler's scan.
+//
+// Returns 0 once the caller runs again, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if envid is the caller, or is not runnable on this CPU,
+//		or either of them has an EDF reservation.
+static int
+sys_yield_to(envid_t envid)
+{
+    struct Env* e;
+    if(envid2env(envid,&e,0))
+        return -E_BAD_ENV;
+
+    // sched_yield_to does not return on success.
+    curenv->env_tf.tf_regs.reg_eax = 0;
+    return sched_yield_to(e);
+}
+
 static int check_addr_scale(unsigned int val,unsigned int min,unsigned int max)
 {
     if( val >= min && val < max && !PGOFF(val))
@@ -107,7 +132,19 @@ sys_exofork(void)
 
     //Just set up needed states.
     child_env->env_tf = curenv->env_tf;
-    child_env->env_status =  ENV_NOT_RUNNABLE;
+    env_set_status(child_env, ENV_NOT_RUNNABLE);
+    sched_dequeue(child_env);
+    env_set_cpumask(child_env, curenv->env_cpumask);
+    child_env->env_quantum = curenv->env_quantum;
+    child_env->env_gang = curenv->env_gang;
+    child_env->env_prio = curenv->env_prio;
+    // Untouched demand-zero pages stay demand-zero in the child.
+    env_region_inherit(child_env, curenv);
+    if ((ret_value = fpu_fork(child_env, curenv)) < 0)
+    {
+        env_free(child_env);
+        return ret_value;
+    }
     // Hawx:
     // For Child part, just pass the return value by the eax assignment.
     child_env->env_tf.tf_regs.reg_eax = 0;
@@ -165,7 +202,11 @@ sys_env_set_status(envid_t envid, int status)
         return -E_INVAL;
     }
 
-    e->env_status = status;
+    env_set_status(e, status);
+    if (status == ENV_RUNNABLE)
+        sched_wakeup(e);
+    else
+        sched_dequeue(e);
 
 #ifdef DEBUG_SYSCALL_C
     cprintf("Enable: index:%d,envid:0x%x, status=0x%x\n",e-envs,e->env_id,e->env_status );
@@ -202,6 +243,27 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
     return 0;
 }
 
+// Set the scheduler activation upcall for 'envid'.  When the timer
+// preempts 'envid', or a message ends its sys_ipc_recv, the kernel
+// pushes a UTrapframe onto its exception stack the next time it runs,
+// with the SA_* events in utf_err, then branches to 'func'.  A null
+// 'func' turns activations off.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_sa_upcall(envid_t envid, void *func)
+{
+    struct Env* e;
+    if(envid2env(envid,&e,1))
+        return -E_BAD_ENV;
+
+    e->env_sa_upcall = func;
+    e->env_sa_pending = 0;
+    return 0;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -343,6 +405,75 @@ sys_page_map(envid_t srcenvid/*In fork: child*/, void *srcva,
     return page_insert(dst_e->env_pgdir,src_page,dstva,perm);
 }
 
+// Unmap every page in [va, va + len) of envid's address space, as if
+// by sys_page_unmap on each page, but with one TLB flush at the end.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or the range does not
+//		lie below UTOP.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+    struct Env* e;
+    if(envid2env(envid,&e,1))
+        return -E_BAD_ENV;
+
+    if(check_addr_scale((uint32_t)va,0,(uint32_t)UTOP)
+            || PGOFF(len) || len > UTOP - (uint32_t)va)
+        return -E_INVAL;
+
+    page_remove_range(e->env_pgdir,va,len);
+
+    return 0;
+}
+
+// Reserve [va, va + len) of envid's address space as demand-zero memory.
+// Nothing is allocated now; the first touch of each page maps a zeroed
+// page with permission 'perm', without a page fault upcall.  Children
+// created by sys_exofork inherit the reservation.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, len is 0, the range
+//		does not lie below UTOP, or it overlaps a reserved range.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if envid has no room for another region.
+static int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+    struct Env* e;
+    if(envid2env(envid,&e,1))
+        return -E_BAD_ENV;
+
+    if(check_addr_scale((uint32_t)va,0,(uint32_t)UTOP)
+            || !len || PGOFF(len) || len > UTOP - (uint32_t)va)
+        return -E_INVAL;
+    if(!(perm & PTE_U) || (perm & ~PTE_SYSCALL))
+        return -E_INVAL;
+
+    return env_region_reserve(e,(uintptr_t)va,len,perm);
+}
+
+// Share envid's demand-zero regions with the environments it creates
+// from now on (see sfork): a page first touched by any of them is
+// mapped into all of them.
+//
+// Returns 0 on success, -E_BAD_ENV if environment envid doesn't
+// currently exist, or the caller doesn't have permission to change it.
+static int
+sys_region_share(envid_t envid)
+{
+    struct Env* e;
+    if(envid2env(envid,&e,1))
+        return -E_BAD_ENV;
+
+    env_region_share(e);
+    return 0;
+}
+
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
 //
@@ -358,7 +489,7 @@ sys_page_unmap(envid_t envid, void *va)
 #ifdef DEBUG_SYSCALL_C
     int i= 0;
     cprintf("===[0x%x]Execute in sys_page_unmap===\n",curenv->env_id);
-    for(i=0 ;i < NENV ; i++)
+    for(i=0 ;i < nenv ; i++)
     {
         if(envs[i].env_status != ENV_FREE && (!(envs[i].env_tf.tf_eflags & FL_IF)))
         {
@@ -492,13 +623,20 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     }
     uenv->env_ipc_from = curenv->env_id;
     uenv->env_ipc_value = value;
-    uenv->env_tf.tf_regs.reg_eax = 0;
     uenv->env_ipc_recving = FALSE;
+    // A receiver polling with sys_ipc_try_recv is not blocked: it picks
+    // the message up on its next call.
+    if(uenv->env_ipc_nowait)
+        return 0;
+    uenv->env_tf.tf_regs.reg_eax = 0;
+    if(uenv->env_sa_upcall)
+        uenv->env_sa_pending |= SA_UNBLOCKED;
 
 #ifdef DEBUG_SYSCALL_C
     cprintf("===[0x%x]finish in ipc_try_send: %d===\n",curenv->env_id,value);
 #endif
-    uenv->env_status =  ENV_RUNNABLE;
+    env_set_status(uenv, ENV_RUNNABLE);
+    sched_wakeup(uenv);
     return 0;
 }
 
@@ -525,19 +663,186 @@ sys_ipc_recv(void *dstva)
         return -E_INVAL;
     }
 
+    // A message already arrived for an earlier sys_ipc_try_recv.
+    if(curenv->env_ipc_nowait && !curenv->env_ipc_recving) {
+        curenv->env_ipc_nowait = FALSE;
+        return 0;
+    }
+
     curenv->env_ipc_recving = TRUE;
+    curenv->env_ipc_nowait = FALSE;
     curenv->env_ipc_dstva = dstva;
-    curenv->env_status = ENV_NOT_RUNNABLE;
+    // Running, so not on the run queue: blocking costs nothing there.
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
 
     //sys_env_set_status
     //1.Set It as the NOT-RUNNABLE.
     //2.When Ok set it as the Runnable @ipc_send
     //3.re-thjnk the round-roubin schedule.
-    while(curenv->env_ipc_recving)
-    {
-        sys_yield();
+    // Blocking gives up the CPU voluntarily.  Unlike sys_yield it does
+    // not end an EDF job: the message is what the job was waiting for.
+    curenv->env_vswitches++;
+    sched_yield();
+
+    return 0;
+}
+
+// Receive without blocking.  The first call makes the caller a receiver
+// at 'dstva', as sys_ipc_recv does, but returns at once; a sender then
+// delivers into the env_ipc fields without waking anybody, and the next
+// sys_ipc_try_recv or sys_ipc_recv returns 0 for that message.
+//
+// Returns 0 if a message has arrived, < 0 otherwise.  Errors are:
+//	-E_IPC_NOT_RECV if no message has arrived yet.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_try_recv (void *dstva)
+{
+    if (IPC_NO_PAGE != dstva && (dstva >= (void *) UTOP || PGOFF (dstva)))
+        return -E_INVAL;
+
+    if (curenv->env_ipc_nowait && !curenv->env_ipc_recving) {
+        curenv->env_ipc_nowait = FALSE;
+        return 0;
     }
+    curenv->env_ipc_recving = TRUE;
+    curenv->env_ipc_nowait = TRUE;
+    curenv->env_ipc_dstva = dstva;
+    return -E_IPC_NOT_RECV;
+}
 
+// Restrict environment envid to the CPUs whose bits are set in 'cpumask'
+// (bit i is CPU i).  The scheduler never runs it anywhere else.  If the
+// caller pins itself away from the CPU it is running on, it gives up the
+// CPU at once and continues on an allowed one.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask names no CPU that exists.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+    struct Env *e;
+
+    if (envid2env(envid, &e, 1))
+        return -E_BAD_ENV;
+    if (!(cpumask & ((1 << ncpu) - 1)))
+        return -E_INVAL;
+
+    env_set_cpumask(e, cpumask);
+    if (e == curenv && !(cpumask & (1 << cpunum()))) {
+        // sched_yield never returns, so hand back the result here.
+        curenv->env_tf.tf_regs.reg_eax = 0;
+        sched_yield();
+    }
+    return 0;
+}
+
+// Set the timeslice envid gets each time the scheduler picks it,
+// in microseconds.  0 restores the default, SCHED_QUANTUM_US.
+// The new length applies from envid's next timeslice.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if us is above SCHED_QUANTUM_MAX_US.
+static int
+sys_env_set_quantum(envid_t envid, uint32_t us)
+{
+    struct Env *e;
+
+    if (envid2env(envid, &e, 1))
+        return -E_BAD_ENV;
+    if (us > SCHED_QUANTUM_MAX_US)
+        return -E_INVAL;
+    e->env_quantum = us;
+    return 0;
+}
+
+// Set the run queue priority of environment envid: 0 is the highest,
+// SCHED_NPRIO - 1 the lowest.  A runnable environment only runs when no
+// environment of a higher priority may run on that CPU, so nobody may
+// set a priority above its own: otherwise any environment could starve
+// all the others.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is out of range or above the caller's.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+    struct Env *e;
+
+    if (envid2env(envid, &e, 1))
+        return -E_BAD_ENV;
+    if (prio < curenv->env_prio || prio >= SCHED_NPRIO)
+        return -E_INVAL;
+    sched_set_prio(e, prio);
+    return 0;
+}
+
+// Give environment envid an earliest-deadline-first reservation of
+// 'budget' microseconds of CPU time every 'period' microseconds, or
+// make it best effort again if 'period' is 0.  It is admitted only if
+// its CPU can still guarantee every reservation (see kern/sched.c).
+// Within each period it runs ahead of best-effort environments until it
+// calls sys_yield or has used its budget.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if budget is 0 or above period, or it is not admitted.
+//		envid is left best effort.
+static int
+sys_env_set_rt(envid_t envid, uint32_t period, uint32_t budget)
+{
+    struct Env *e;
+
+    if (envid2env(envid, &e, 1))
+        return -E_BAD_ENV;
+    return sched_rt_admit(e, period, budget);
+}
+
+// Start a new gang and make the caller its first member.  Its children
+// inherit the gang; the scheduler runs the members at the same time.
+//
+// Returns the gang's ID.
+static int
+sys_gang_create(void)
+{
+    curenv->env_gang = sched_gang_create();
+    return curenv->env_gang;
+}
+
+// Move environment envid into gang 'gang', or out of any gang if
+// 'gang' is 0.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if 'gang' was never created.
+static int
+sys_gang_join(envid_t envid, int gang)
+{
+    struct Env *e;
+
+    if (envid2env(envid, &e, 1))
+        return -E_BAD_ENV;
+    if (gang && !sched_gang_exists(gang))
+        return -E_INVAL;
+    e->env_gang = gang;
+    return 0;
+}
+
+// Store the nanoseconds since boot at *ns.
+// Destroys the environment on memory errors.
+static int
+sys_time_ns(uint64_t *ns)
+{
+    user_mem_assert(curenv, ns, sizeof(*ns), PTE_U | PTE_W | PTE_P);
+    *ns = time_ns();
     return 0;
 }
 
@@ -564,6 +869,8 @@ syscall (uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3,
     case SYS_yield:
          sys_yield();
          return 0;
+    case SYS_yield_to:
+         return sys_yield_to(a1);
     case SYS_exofork:
          return sys_exofork();
     case SYS_page_alloc:
@@ -572,14 +879,38 @@ syscall (uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3,
          return sys_page_map(a1,(void*)a2,a3,(void*)a4,a5);
     case SYS_page_unmap:
          return sys_page_unmap(a1,(void*)a2);
+    case SYS_page_unmap_range:
+         return sys_page_unmap_range(a1,(void*)a2,a3);
+    case SYS_region_reserve:
+         return sys_region_reserve(a1,(void*)a2,a3,a4);
+    case SYS_region_share:
+         return sys_region_share(a1);
     case SYS_env_set_status:
          return sys_env_set_status(a1,a2);
     case SYS_env_set_pgfault_upcall:
          return sys_env_set_pgfault_upcall(a1,(void*)a2);
+    case SYS_env_set_sa_upcall:
+         return sys_env_set_sa_upcall(a1,(void*)a2);
     case SYS_ipc_try_send:
          return sys_ipc_try_send(a1,a2,(void*)a3,a4);
     case SYS_ipc_recv:
          return sys_ipc_recv((void*)a1);
+    case SYS_ipc_try_recv:
+         return sys_ipc_try_recv((void*)a1);
+    case SYS_env_set_affinity:
+         return sys_env_set_affinity(a1,a2);
+    case SYS_env_set_quantum:
+         return sys_env_set_quantum(a1,a2);
+    case SYS_env_set_priority:
+         return sys_env_set_priority(a1,a2);
+    case SYS_env_set_rt:
+         return sys_env_set_rt(a1,a2,a3);
+    case SYS_gang_create:
+         return sys_gang_create();
+    case SYS_gang_join:
+         return sys_gang_join(a1,a2);
+    case SYS_time_ns:
+         return sys_time_ns((uint64_t*)a1);
     default:
         return -E_INVAL;
     }
@@ -13,6 +13,8 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/epoch.h>
 
 extern uint32_t vects[];
 
@@ -217,6 +219,14 @@ trap_dispatch (struct Trapframe *tf)
             case IRQ_TIMER:
 //                cprintf("curenv->env_id:0x%x is in\n",curenv->env_id);
                 lapic_eoi(); //bug_020
+                if (curenv)
+                {
+                    curenv->env_ivswitches++;
+                    if (curenv->env_sa_upcall)
+                        curenv->env_sa_pending |= SA_PREEMPTED;
+                }
+                env_reclaim (ENV_RECLAIM_BATCH);
+                epoch_collect ();
                 sched_yield();
                 break;
             case IRQ_KBD:
@@ -250,6 +260,38 @@ trap_dispatch (struct Trapframe *tf)
             case T_BRKPT:
                 breakpoint_handler (tf);
                 break;
+            case T_DEVICE:
+                if ((tf->tf_cs & 3) == 0)
+                    panic ("FPU used in the kernel");
+                fpu_trap ();
+                break;
+            case T_IPI_WAKEUP:
+                // Just wakes the CPU up; trap() reschedules.
+                lapic_eoi();
+                break;
+            case T_IPI_GANG:
+                // Some CPU started a gang's slice.  Switch if it gave
+                // us a member; a halted CPU reschedules in trap() anyway.
+                lapic_eoi();
+                if (thiscpu->cpu_gang_next && curenv)
+                {
+                    curenv->env_ivswitches++;
+                    if (curenv->env_sa_upcall)
+                        curenv->env_sa_pending |= SA_PREEMPTED;
+                    sched_yield();
+                }
+                break;
+            case T_IPI_RESCHED:
+                // An EDF env this CPU runs ahead of curenv woke up.
+                lapic_eoi();
+                if (curenv)
+                {
+                    curenv->env_ivswitches++;
+                    if (curenv->env_sa_upcall)
+                        curenv->env_sa_pending |= SA_PREEMPTED;
+                    sched_yield();
+                }
+                break;
             case T_SYSCALL:
                 //Extract the parameters
                 XARG_SYSCALL_PRAR (reg_eax) = syscall (XARG_SYSCALL_PRAR (reg_eax),
@@ -316,6 +358,9 @@ trap (struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Entering the kernel is a quiescent point, see kern/epoch.c.
+	epoch_enter();
+
 
 #ifdef bug_017
         //lock_kernel();
@@ -324,6 +369,10 @@ trap (struct Trapframe *tf)
 //            cprintf("-----Start---\n");
 //        assert(!(read_eflags() & FL_IF));
 	if ((tf->tf_cs & 3) == 3) {
+		// Charge the user time before waiting on the kernel lock.
+		uint64_t now = read_tsc();
+		curenv->env_utime += now - thiscpu->cpu_tsc_mark;
+		thiscpu->cpu_tsc_mark = now;
 #ifndef bug_017
                 lock_kernel();
 #endif
@@ -354,6 +403,15 @@ trap (struct Trapframe *tf)
             // fails, DO NOT be tempted to fix it by inserting a "cli" in
             // the interrupt path.
             assert(!(read_eflags() & FL_IF));
+
+            // An interrupt woke this CPU out of sched_halt, which gave up
+            // the kernel lock.  Take it back; there is no curenv, so we
+            // end up in sched_yield below.
+            if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+            {
+                lock_kernel();
+                sched_idle_cpus &= ~(1 << cpunum());
+            }
         }
 
 	// Record that tf is the last real trapframe so
@@ -421,6 +479,10 @@ page_fault_handler (struct Trapframe *tf)
     }
     ptep = pgdir_walk (curenv->env_pgdir, (void *) fault_va, NO_CREATE);
 
+    // First touch of a demand-zero page: map it and retry, no upcall.
+    if (!(tf->tf_err & FEC_PR) && 0 == env_region_fault (curenv, fault_va))
+        env_run (curenv);
+
 
     // Handle kernel-mode page faults.
 
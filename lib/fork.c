@@ -133,6 +133,15 @@ duppage(envid_t envid, unsigned pn)
         return 0;
     }
     */
+    // Pages marked PTE_SHARE stay shared with the child.
+    if(vpt[pn] & PTE_SHARE) {
+        return sys_page_map(0,
+                (void*)PGNUM2LA(pn),
+                envid,
+                (void*)PGNUM2LA(pn),
+                vpt[pn] & PTE_SYSCALL);
+    }
+
     //For read only page
     if(!(vpt[pn] & (PTE_W | PTE_COW))) {
         sys_page_map(0,
@@ -317,10 +326,83 @@ fork(void)
 #endif 
 }
 
-// Challenge!
-int
+//
+// Map our virtual page pn into envid at the same address, shared: each
+// sees the other's writes, and both mappings are marked PTE_SHARE so
+// that fork keeps sharing them too.  A copy-on-write page is made
+// private first, or the next write to it would split the two apart.
+//
+static int
+sharepage(envid_t envid, unsigned pn)
+{
+    void *va = (void*)PGNUM2LA(pn);
+    int r, perm = vpt[pn] & PTE_SYSCALL;
+
+    if(perm & PTE_COW) {
+        if((r = sys_page_alloc(0, (void*)PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+            return r;
+        memmove((void*)PFTEMP, va, PGSIZE);
+        perm = (perm | PTE_W) & ~PTE_COW;
+        if((r = sys_page_map(0, (void*)PFTEMP, 0, va, perm)) < 0)
+            return r;
+        sys_page_unmap(0, (void*)PFTEMP);
+    }
+
+    perm |= PTE_SHARE;
+    if((r = sys_page_map(0, va, 0, va, perm)) < 0)
+        return r;
+    return sys_page_map(0, va, envid, va, perm);
+}
+
+//
+// Create a thread: a child that shares our whole address space except
+// the stack region [USTACKTOP - PTSIZE, USTACKTOP), which it gets a
+// copy-on-write copy of (thisenv lives at its top).  Demand-zero
+// regions, the malloc heap among them, are shared too, including pages
+// neither of us has touched yet.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-    panic("sfork not implemented");
-    return -E_INVAL;
+    envid_t child_envid;
+    unsigned pgn;
+    int r;
+
+    set_pgfault_handler(pgfault);
+    if((r = malloc_init()) < 0 || (r = sys_region_share(0)) < 0)
+        return r;
+    child_envid = sys_exofork();
+    if(child_envid < 0)
+        return child_envid;
+    if(0 == child_envid)
+    {
+        thisenv = &envs[ENVX(sys_getenvid())];
+        return 0;
+    }
+
+    sys_env_set_pgfault_upcall(child_envid, _pgfault_upcall);
+    for(pgn = 0; pgn < PGNUM(UXSTACKBASE); pgn++)
+    {
+        if((PTE_P | PTE_U) != (vpd[pgn >> 10] & (PTE_P | PTE_U)))
+        {
+            pgn |= NPTENTRIES - 1;
+            continue;
+        }
+        if((PTE_P | PTE_U) != (vpt[pgn] & (PTE_P | PTE_U)))
+            continue;
+        if(pgn >= PGNUM(USTACKTOP - PTSIZE) && pgn < PGNUM(USTACKTOP))
+            r = duppage(child_envid, pgn);
+        else
+            r = sharepage(child_envid, pgn);
+        if(r < 0)
+            panic("sfork: %e", r);
+    }
+    if((r = sys_page_alloc(child_envid, (void*)UXSTACKBASE, PTE_U | PTE_W | PTE_P)) < 0)
+        panic("sfork: %e", r);
+
+    if((r = sys_env_set_status(child_envid, ENV_RUNNABLE)) < 0)
+        panic("sys_env_set_status: %e", r);
+    return child_envid;
 }
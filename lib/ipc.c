@@ -27,6 +27,11 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
     //How to distinguish 0 and NULL.
 
     int32_t ret = 0;
+
+    // Don't block sibling user-level threads.
+    if(uthread_active())
+        return uthread_ipc_recv(from_env_store, pg, perm_store);
+
     ret = sys_ipc_recv(pg == NULL ? IPC_NO_PAGE : pg);
 
     if(from_env_store != NULL){
@@ -57,7 +62,9 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
     cprintf("===[0x%x]Execute in ipc_try_send: %d===\n",thisenv->env_id,val);
 #endif
     do{
-        sys_yield();
+        // Let sibling threads run first; yield the CPU if there are none.
+        if(!uthread_yield())
+            sys_yield();
         ret = sys_ipc_try_send(
             to_env,
             val,
@@ -76,9 +83,16 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 envid_t
 ipc_find_env(enum EnvType type)
 {
+	uintptr_t end;
 	int i;
-	for (i = 0; i < NENV; i++)
+
+	// The kernel maps only the envs it has, maybe fewer than NENV.
+	for (i = 0; i < NENV; i++) {
+		end = (uintptr_t) &envs[i + 1] - 1;
+		if (!(vpd[PDX(end)] & PTE_P) || !(vpt[PGNUM(end)] & PTE_P))
+			break;
 		if (envs[i].env_type == type)
 			return envs[i].env_id;
+	}
 	return 0;
 }
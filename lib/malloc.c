@@ -0,0 +1,385 @@
+// User-level heap allocator.
+//
+// Requests of up to MAXSMALL bytes are rounded up to a power-of-two
+// size class and carved out of pages that each hold objects of a single
+// class.  Freed objects go on a per-class free list.  Larger requests
+// get a run of whole pages, and freeing a run hands its pages back to
+// the kernel and merges it with the free runs on either side; a free
+// run that reaches the top of the heap lowers heap_brk instead.
+//
+// The whole heap [UHEAP, UHEAP + UHEAPSIZE) is reserved as demand-zero
+// memory on first use, so growing it is just a pointer bump: the kernel
+// maps each page the first time it is touched, without a system call.
+//
+// Threads created by sfork share the heap.  Each keeps a small cache of
+// free objects per class, so most calls never touch malloc_lock, which
+// protects everything else.  A thread takes one of NCACHE cache slots
+// the first time it needs one, keeps its number in thisslot, and leaves
+// the slot to the next thread once it has exited.  Threads beyond
+// NCACHE go through malloc_lock every time.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define MINSHIFT	4			// Smallest class is 16 bytes
+#define NCLASS		8			// ... and largest 2048
+#define MAXSMALL	(1 << (MINSHIFT + NCLASS - 1))
+#define HEAPPAGES	(UHEAPSIZE / PGSIZE)
+#define CACHEBATCH	16			// Objects moved per refill/drain
+#define NCACHE		64			// Threads with a cache
+
+// What each heap page holds: CLASSPAGE(c) for objects of class c,
+// RUNPAGE(n) for the first page of an n-page run, FREEPAGE(n) for both
+// the first and the last page of an n-page free run, so that free can
+// find the free runs next to it.  Other pages are left 0.
+#define CLASSPAGE(c)	((c) + 1)
+#define RUNPAGE(n)	(0x80000000 | (n))
+#define ISRUN(info)	((info) & 0x80000000)
+#define RUNPAGES(info)	((info) & ~0x80000000)
+#define FREEPAGE(n)	(0x40000000 | (n))
+#define ISFREE(info)	((info) & 0x40000000)
+#define FREEPAGES(info)	((info) & ~0x40000000)
+
+struct FreeObj {
+	struct FreeObj *next;
+};
+
+// Per-thread object caches.
+struct Cache {
+	envid_t owner;				// Thread using it, 0 if none
+	struct FreeObj *objs[NCLASS];
+	int nobjs[NCLASS];
+};
+
+static volatile uint32_t malloc_lock;
+static struct Cache caches[NCACHE];
+static bool heap_ready;
+static uint32_t heap_brk;		// Pages handed out from the top
+static uint32_t heap_low;		// No free run starts below it
+static uint32_t pageinfo[HEAPPAGES];
+static struct FreeObj *freeobjs[NCLASS];
+
+static void *
+page2va(uint32_t page)
+{
+	return (void *) (UHEAP + page * PGSIZE);
+}
+
+static uint32_t
+va2page(void *va)
+{
+	return ((uintptr_t) va - UHEAP) / PGSIZE;
+}
+
+static void
+lock(void)
+{
+	while (xchg(&malloc_lock, 1) != 0)
+		asm volatile("pause");
+}
+
+static void
+unlock(void)
+{
+	xchg(&malloc_lock, 0);
+}
+
+static bool
+alive(envid_t id)
+{
+	const volatile struct Env *e = &envs[ENVX(id)];
+
+	return e->env_id == id && e->env_status != ENV_FREE
+		&& e->env_status != ENV_RECLAIM;
+}
+
+// Our cache, or NULL if every slot belongs to a live thread.
+static struct Cache *
+mycache(void)
+{
+	struct Cache *cache;
+	struct FreeObj *o;
+	envid_t id = thisenv->env_id;
+	int i, c;
+
+	// thisslot is inherited through fork and sfork, hence the owner check.
+	if (thisslot > 0 && thisslot <= NCACHE
+	    && caches[thisslot - 1].owner == id)
+		return &caches[thisslot - 1];
+
+	lock();
+	for (i = 0; i < NCACHE; i++)
+		if (!caches[i].owner || !alive(caches[i].owner))
+			break;
+	if (i == NCACHE) {
+		unlock();
+		return NULL;
+	}
+	// Give back whatever an exited owner left behind.
+	cache = &caches[i];
+	for (c = 0; c < NCLASS; c++)
+		while ((o = cache->objs[c])) {
+			cache->objs[c] = o->next;
+			o->next = freeobjs[c];
+			freeobjs[c] = o;
+		}
+	memset(cache->nobjs, 0, sizeof(cache->nobjs));
+	cache->owner = id;
+	unlock();
+	thisslot = i + 1;
+	return cache;
+}
+
+static int
+size2class(size_t n)
+{
+	int c = 0;
+
+	while ((1 << (MINSHIFT + c)) < n)
+		c++;
+	return c;
+}
+
+// Reserve the heap if that has not happened yet.  sfork calls this
+// before sharing our regions, so threads get one heap between them.
+int
+malloc_init(void)
+{
+	int r;
+
+	if (heap_ready)
+		return 0;
+	if ((r = sys_region_reserve(0, (void *) UHEAP, UHEAPSIZE,
+				    PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	heap_ready = 1;
+	return 0;
+}
+
+static void
+set_free(uint32_t page, uint32_t npages)
+{
+	pageinfo[page] = pageinfo[page + npages - 1] = FREEPAGE(npages);
+}
+
+// Pages in the block of pages starting at 'page'.
+static uint32_t
+block_pages(uint32_t page)
+{
+	uint32_t info = pageinfo[page];
+
+	if (ISRUN(info))
+		return RUNPAGES(info);
+	if (ISFREE(info))
+		return FREEPAGES(info);
+	return 1;
+}
+
+// Allocate npages contiguous heap pages, from the lowest free run big
+// enough or else from the top.  Returns a page number, or -1 if the
+// heap is exhausted.  Called with malloc_lock held.
+static int32_t
+heap_pages(uint32_t npages)
+{
+	uint32_t page, n;
+
+	if (malloc_init() < 0)
+		return -1;
+
+	for (page = heap_low; page < heap_brk; page += block_pages(page)) {
+		if (!ISFREE(pageinfo[page])
+		    || (n = FREEPAGES(pageinfo[page])) < npages)
+			continue;
+		pageinfo[page + n - 1] = 0;
+		if (n > npages)
+			set_free(page + npages, n - npages);
+		if (page == heap_low)
+			heap_low += npages;
+		return page;
+	}
+
+	if (npages > HEAPPAGES - heap_brk)
+		return -1;
+	page = heap_brk;
+	heap_brk += npages;
+	return page;
+}
+
+void *
+malloc(size_t n)
+{
+	struct FreeObj *o;
+	struct Cache *cache;
+	int32_t page;
+	size_t size;
+	int c;
+
+	if (n == 0)
+		return NULL;
+
+	if (n > MAXSMALL) {
+		if (n > UHEAPSIZE)
+			return NULL;
+		size = ROUNDUP(n, PGSIZE) / PGSIZE;
+		lock();
+		if ((page = heap_pages(size)) >= 0)
+			pageinfo[page] = RUNPAGE(size);
+		unlock();
+		return page < 0 ? NULL : page2va(page);
+	}
+
+	c = size2class(n);
+	cache = mycache();
+	if (!cache || !cache->objs[c]) {
+		lock();
+		if (!freeobjs[c] && (page = heap_pages(1)) >= 0) {
+			// Carve a fresh page into objects of this class.
+			pageinfo[page] = CLASSPAGE(c);
+			size = 1 << (MINSHIFT + c);
+			for (n = PGSIZE; n >= size; n -= size) {
+				o = (struct FreeObj *) ((char *) page2va(page) + n - size);
+				o->next = freeobjs[c];
+				freeobjs[c] = o;
+			}
+		}
+		if (!cache) {
+			if ((o = freeobjs[c]))
+				freeobjs[c] = o->next;
+			unlock();
+			return o;
+		}
+		// Refill our cache.
+		while (freeobjs[c] && cache->nobjs[c] < CACHEBATCH) {
+			o = freeobjs[c];
+			freeobjs[c] = o->next;
+			o->next = cache->objs[c];
+			cache->objs[c] = o;
+			cache->nobjs[c]++;
+		}
+		unlock();
+		if (!cache->objs[c])
+			return NULL;
+	}
+	o = cache->objs[c];
+	cache->objs[c] = o->next;
+	cache->nobjs[c]--;
+	return o;
+}
+
+// How many bytes the block at v can hold.
+static size_t
+block_size(void *v)
+{
+	uint32_t info;
+
+	if ((uintptr_t) v < UHEAP || (uintptr_t) v >= UHEAP + UHEAPSIZE
+	    || !(info = pageinfo[va2page(v)]) || ISFREE(info))
+		panic("malloc: bad pointer %08x", v);
+	if (ISRUN(info)) {
+		if (PGOFF(v))
+			panic("malloc: bad pointer %08x", v);
+		return RUNPAGES(info) * PGSIZE;
+	}
+	return 1 << (MINSHIFT + info - 1);
+}
+
+void
+free(void *v)
+{
+	struct FreeObj *o;
+	struct Cache *cache;
+	uint32_t page, info, n, m;
+	int c;
+
+	if (v == NULL)
+		return;
+	block_size(v);		// Sanity check
+
+	page = va2page(v);
+	info = pageinfo[page];
+	if (!ISRUN(info)) {
+		c = info - 1;
+		cache = mycache();
+		o = v;
+		if (!cache) {
+			lock();
+			o->next = freeobjs[c];
+			freeobjs[c] = o;
+			unlock();
+			return;
+		}
+		o->next = cache->objs[c];
+		cache->objs[c] = o;
+		if (++cache->nobjs[c] < 2 * CACHEBATCH)
+			return;
+		// Too many: give a batch back for other threads.
+		lock();
+		while (cache->nobjs[c] > CACHEBATCH) {
+			o = cache->objs[c];
+			cache->objs[c] = o->next;
+			cache->nobjs[c]--;
+			o->next = freeobjs[c];
+			freeobjs[c] = o;
+		}
+		unlock();
+		return;
+	}
+
+	// The pages go back to the kernel but stay demand-zero, so the
+	// run can be handed out again without another system call.
+	n = RUNPAGES(info);
+	sys_page_unmap_range(0, v, n * PGSIZE);
+	lock();
+	pageinfo[page] = 0;
+	if (page > 0 && ISFREE(info = pageinfo[page - 1])) {
+		m = FREEPAGES(info);
+		pageinfo[page - 1] = pageinfo[page - m] = 0;
+		page -= m;
+		n += m;
+	}
+	if (page + n < heap_brk && ISFREE(info = pageinfo[page + n])) {
+		m = FREEPAGES(info);
+		pageinfo[page + n] = pageinfo[page + n + m - 1] = 0;
+		n += m;
+	}
+	if (page + n == heap_brk)
+		heap_brk = page;
+	else
+		set_free(page, n);
+	heap_low = MIN(heap_low, page);
+	unlock();
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *v;
+
+	if (size && nmemb > (size_t) -1 / size)
+		return NULL;
+	if ((v = malloc(nmemb * size)))
+		memset(v, 0, nmemb * size);
+	return v;
+}
+
+void *
+realloc(void *v, size_t n)
+{
+	void *nv;
+	size_t old;
+
+	if (v == NULL)
+		return malloc(n);
+	if (n == 0) {
+		free(v);
+		return NULL;
+	}
+	old = block_size(v);
+	if (n <= old && (old <= MAXSMALL || n > MAXSMALL))
+		return v;
+	if (!(nv = malloc(n)))
+		return NULL;
+	memmove(nv, v, MIN(old, n));
+	free(v);
+	return nv;
+}
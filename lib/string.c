@@ -1,6 +1,7 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <inc/string.h>
+#include <inc/x86.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -121,10 +122,109 @@ strfind (const char *s, char c)
 }
 
 #if ASM
+// Word-aligned fills and copies of a page or more use SSE2
+// non-temporal stores (movnti) when the CPU has them: that much fresh
+// data would otherwise push the caller's working set out of the
+// cache.  movnti stores from general registers, so the kernel can use
+// it without touching any FPU state.
+#define NT_MIN		4096
+
+static int string_sse2 = -1;    // CPU has SSE2; -1 until we ask cpuid
+
+bool
+use_nt (const void *dst, size_t n)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    if (n < NT_MIN || (int) dst % 4 != 0)
+        return 0;
+    if (string_sse2 < 0)
+    {
+        cpuid (1, &eax, &ebx, &ecx, &edx);
+        string_sse2 = (edx >> 26) & 1;
+    }
+    return string_sse2;
+}
+
+// Fill 'blocks' 64-byte blocks at v with the word c, bypassing the cache.
+void
+nt_fill64 (void *v, uint32_t c, size_t blocks)
+{
+    asm volatile ("1:\n\t"
+                  "movnti %2, 0(%0)\n\t"
+                  "movnti %2, 4(%0)\n\t"
+                  "movnti %2, 8(%0)\n\t"
+                  "movnti %2, 12(%0)\n\t"
+                  "movnti %2, 16(%0)\n\t"
+                  "movnti %2, 20(%0)\n\t"
+                  "movnti %2, 24(%0)\n\t"
+                  "movnti %2, 28(%0)\n\t"
+                  "movnti %2, 32(%0)\n\t"
+                  "movnti %2, 36(%0)\n\t"
+                  "movnti %2, 40(%0)\n\t"
+                  "movnti %2, 44(%0)\n\t"
+                  "movnti %2, 48(%0)\n\t"
+                  "movnti %2, 52(%0)\n\t"
+                  "movnti %2, 56(%0)\n\t"
+                  "movnti %2, 60(%0)\n\t"
+                  "addl $64, %0\n\t"
+                  "decl %1\n\t"
+                  "jnz 1b\n\t"
+                  "sfence"
+                  :"+r" (v), "+r" (blocks):"r" (c):"cc", "memory");
+}
+
+// Copy 'blocks' 64-byte blocks forward from s to d, bypassing the cache.
+void
+nt_copy64 (void *d, const void *s, size_t blocks)
+{
+    asm volatile ("1:\n\t"
+                  "movl 0(%1), %%eax\n\t"
+                  "movl 4(%1), %%edx\n\t"
+                  "movnti %%eax, 0(%0)\n\t"
+                  "movnti %%edx, 4(%0)\n\t"
+                  "movl 8(%1), %%eax\n\t"
+                  "movl 12(%1), %%edx\n\t"
+                  "movnti %%eax, 8(%0)\n\t"
+                  "movnti %%edx, 12(%0)\n\t"
+                  "movl 16(%1), %%eax\n\t"
+                  "movl 20(%1), %%edx\n\t"
+                  "movnti %%eax, 16(%0)\n\t"
+                  "movnti %%edx, 20(%0)\n\t"
+                  "movl 24(%1), %%eax\n\t"
+                  "movl 28(%1), %%edx\n\t"
+                  "movnti %%eax, 24(%0)\n\t"
+                  "movnti %%edx, 28(%0)\n\t"
+                  "movl 32(%1), %%eax\n\t"
+                  "movl 36(%1), %%edx\n\t"
+                  "movnti %%eax, 32(%0)\n\t"
+                  "movnti %%edx, 36(%0)\n\t"
+                  "movl 40(%1), %%eax\n\t"
+                  "movl 44(%1), %%edx\n\t"
+                  "movnti %%eax, 40(%0)\n\t"
+                  "movnti %%edx, 44(%0)\n\t"
+                  "movl 48(%1), %%eax\n\t"
+                  "movl 52(%1), %%edx\n\t"
+                  "movnti %%eax, 48(%0)\n\t"
+                  "movnti %%edx, 52(%0)\n\t"
+                  "movl 56(%1), %%eax\n\t"
+                  "movl 60(%1), %%edx\n\t"
+                  "movnti %%eax, 56(%0)\n\t"
+                  "movnti %%edx, 60(%0)\n\t"
+                  "addl $64, %0\n\t"
+                  "addl $64, %1\n\t"
+                  "decl %2\n\t"
+                  "jnz 1b\n\t"
+                  "sfence"
+                  :"+r" (d), "+r" (s), "+r" (blocks)::"eax", "edx", "cc",
+                  "memory");
+}
+
 void *
 memset (void *v, int c, size_t n)
 {
     char *p;
+    size_t done = 0;
 
     if (n == 0)
         return v;
@@ -132,8 +232,13 @@ memset (void *v, int c, size_t n)
     {
         c &= 0xFF;
         c = (c << 24) | (c << 16) | (c << 8) | c;
-        asm volatile ("cld; rep stosl\n"::"D" (v), "a" (c), "c" (n / 4):"cc",
-                      "memory");
+        if (use_nt (v, n))
+        {
+            done = n & ~63;
+            nt_fill64 (v, c, done / 64);
+        }
+        asm volatile ("cld; rep stosl\n"::"D" ((char *) v + done), "a" (c),
+                      "c" ((n - done) / 4):"cc", "memory");
     }
     else
         asm volatile ("cld; rep stosb\n"::"D" (v), "a" (c), "c" (n):"cc",
@@ -168,11 +273,31 @@ memmove (void *dst, const void *src, size_t n)
     }
     else
     {
+        // Non-temporal stores are weakly ordered, so only use them
+        // when the source can't be overwritten along the way.
+        if ((int) s % 4 == 0 && use_nt (d, n) && (d + n <= s || s + n <= d))
+        {
+            nt_copy64 (d, s, n / 64);
+            s += n & ~63;
+            d += n & ~63;
+            n %= 64;
+        }
         if ((int) s % 4 == 0 && (int) d % 4 == 0 && n % 4 == 0)
         {
             asm volatile ("cld; rep movsl\n"::"D" (d), "S" (s),
                           "c" (n / 4):"cc", "memory");
         }
+        else if (n >= 64)
+        {
+            // Medium and misaligned: words first, then the tail.
+            size_t words = n / 4;
+
+            asm volatile ("cld; rep movsl\n\t"
+                          "movl %3, %%ecx\n\t"
+                          "rep movsb"
+                          :"+D" (d), "+S" (s), "+c" (words)
+                          :"r" (n % 4):"cc", "memory");
+        }
         else
         {
 
@@ -222,6 +347,30 @@ memmove (void *dst, const void *src, size_t n)
 
     return dst;
 }
+
+// Without ASM there are no non-temporal stores: use_nt always says no,
+// and the block fills and copies are plain loops.
+bool
+use_nt (const void *dst, size_t n)
+{
+    return 0;
+}
+
+void
+nt_fill64 (void *v, uint32_t c, size_t blocks)
+{
+    uint32_t *p = v;
+    size_t n = blocks * 16;
+
+    while (n-- > 0)
+        *p++ = c;
+}
+
+void
+nt_copy64 (void *d, const void *s, size_t blocks)
+{
+    memmove (d, s, blocks * 64);
+}
 #endif
 
 /* sigh - gcc emits references to this for structure assignments! */
@@ -62,6 +62,12 @@ sys_yield(void)
 	syscall(SYS_yield, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_yield_to(envid_t envid)
+{
+	return syscall(SYS_yield_to, 0, envid, 0, 0, 0, 0);
+}
+
 int
 sys_page_alloc(envid_t envid, void *va, int perm)
 {
@@ -80,6 +86,30 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
+int
+sys_region_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_region_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_env_set_sa_upcall(envid_t envid, void *upcall)
+{
+	return syscall(SYS_env_set_sa_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
+}
+
+int
+sys_region_share(envid_t envid)
+{
+	return syscall(SYS_region_share, 1, envid, 0, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -106,3 +136,53 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_try_recv(void *dstva)
+{
+	return syscall(SYS_ipc_try_recv, 0, (uint32_t) dstva, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
+int
+sys_env_set_quantum(envid_t envid, uint32_t us)
+{
+	return syscall(SYS_env_set_quantum, 1, envid, us, 0, 0, 0);
+}
+
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 0, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_rt(envid_t envid, uint32_t period, uint32_t budget)
+{
+	return syscall(SYS_env_set_rt, 0, envid, period, budget, 0, 0);
+}
+
+int
+sys_gang_create(void)
+{
+	return syscall(SYS_gang_create, 1, 0, 0, 0, 0, 0);
+}
+
+int
+sys_gang_join(envid_t envid, int gang)
+{
+	return syscall(SYS_gang_join, 1, envid, gang, 0, 0, 0);
+}
+
+uint64_t
+sys_time_ns(void)
+{
+	uint64_t ns;
+
+	syscall(SYS_time_ns, 0, (uint32_t) &ns, 0, 0, 0, 0);
+	return ns;
+}
@@ -0,0 +1,299 @@
+// User-level threads.
+//
+// Threads run inside one environment and are cooperative: a thread runs
+// until it calls uthread_yield or uthread_exit, or waits in ipc_recv.
+// A switch saves only the callee-saved registers (see uswitch.S), so it
+// costs a few dozen instructions and no system call.
+//
+// With uthread_preempt, the kernel's scheduler activations make this
+// preemptive: when the timer takes the CPU from the environment, the
+// upcall switches to another thread as soon as the environment runs
+// again.
+//
+// Thread 0 is the environment's own thread on the normal user stack.
+// Every other thread gets UTHREAD_STACKPAGES pages, allocated with
+// sys_page_alloc, in its slot above UTSTACKS, with an unmapped guard
+// page below them.  Slots and their stacks are reused after exit.
+
+#include <inc/lib.h>
+
+#define SLOTSIZE	((UTHREAD_STACKPAGES + 1) * PGSIZE)
+
+enum {
+	UT_FREE = 0,
+	UT_READY,
+	UT_RUNNING,
+	UT_IPCWAIT,
+};
+
+struct UThread {
+	uint32_t ut_esp;		// Saved %esp while switched out
+	int ut_state;
+	struct UThread *ut_next;	// Run queue or IPC wait queue link
+	bool ut_stack;			// Stack pages allocated
+	void (*ut_fn)(void *);
+	void *ut_arg;
+
+	// ipc_recv while other threads run
+	void *ut_ipc_pg;
+	int32_t ut_ipc_ret;		// Value received, or error
+	envid_t ut_ipc_from;
+	int ut_ipc_perm;
+};
+
+struct UQueue {
+	struct UThread *head, *tail;
+};
+
+void uswitch(uint32_t *save_esp, uint32_t esp);
+void _sa_upcall(void);
+void _sa_resume(void);
+
+static struct UThread threads[UTHREAD_MAX];
+static struct UThread *current;
+static struct UQueue runq;
+static struct UQueue ipcq;
+static int nthreads = 1;
+// Set while the library changes its queues; activations leave the
+// running thread alone then.
+static volatile bool busy;
+
+static void
+enqueue(struct UQueue *q, struct UThread *t)
+{
+	t->ut_next = NULL;
+	if (q->tail)
+		q->tail->ut_next = t;
+	else
+		q->head = t;
+	q->tail = t;
+}
+
+static struct UThread *
+dequeue(struct UQueue *q)
+{
+	struct UThread *t;
+
+	if ((t = q->head) && !(q->head = t->ut_next))
+		q->tail = NULL;
+	return t;
+}
+
+static struct UThread *
+self(void)
+{
+	if (!current) {
+		current = &threads[0];
+		current->ut_state = UT_RUNNING;
+	}
+	return current;
+}
+
+// Hand the result of a receive to thread t.
+static void
+received(struct UThread *t, int32_t r)
+{
+	t->ut_ipc_ret = r ? r : thisenv->env_ipc_value;
+	t->ut_ipc_from = r ? 0 : thisenv->env_ipc_from;
+	t->ut_ipc_perm = r ? 0 : thisenv->env_ipc_perm;
+}
+
+static void *
+ipc_pg(struct UThread *t)
+{
+	return t->ut_ipc_pg ? t->ut_ipc_pg : IPC_NO_PAGE;
+}
+
+// Pick the next thread to run.  While threads wait for IPC, poll with
+// sys_ipc_try_recv first, so a message readies the oldest waiter even
+// when other threads keep the run queue busy.  If every live thread
+// waits, block the environment in sys_ipc_recv instead.  Returns NULL
+// only if no thread is left at all.
+static struct UThread *
+pick(void)
+{
+	struct UThread *t;
+	int32_t r;
+
+	if (ipcq.head && runq.head
+	    && (r = sys_ipc_try_recv(ipc_pg(ipcq.head))) != -E_IPC_NOT_RECV) {
+		t = dequeue(&ipcq);
+		received(t, r);
+		t->ut_state = UT_READY;
+		enqueue(&runq, t);
+	}
+	if ((t = dequeue(&runq)) || !(t = dequeue(&ipcq)))
+		return t;
+
+	received(t, sys_ipc_recv(ipc_pg(t)));
+	return t;
+}
+
+// Switch from the current thread, already queued wherever it belongs
+// (or freed), to the next one.
+static void
+reschedule(void)
+{
+	struct UThread *prev = current, *next;
+
+	if (!(next = pick()))
+		exit();
+	next->ut_state = UT_RUNNING;
+	if (next == prev)
+		return;
+	current = next;
+	uswitch(&prev->ut_esp, next->ut_esp);
+}
+
+static void
+uthread_entry(void)
+{
+	busy = 0;
+	current->ut_fn(current->ut_arg);
+	uthread_exit();
+}
+
+// Start a thread running fn(arg).  It runs the next time the current
+// thread yields.  Returns its id, or < 0 on error.
+int
+uthread_create(void (*fn)(void *), void *arg)
+{
+	struct UThread *t;
+	uint32_t *sp;
+	uintptr_t stack;
+	int i, j, r;
+
+	busy = 1;
+	self();
+	for (i = 1; i < UTHREAD_MAX && threads[i].ut_state != UT_FREE; i++)
+		;
+	if (i == UTHREAD_MAX) {
+		busy = 0;
+		return -E_NO_FREE_ENV;
+	}
+	t = &threads[i];
+
+	stack = UTSTACKS + i * SLOTSIZE + PGSIZE;
+	if (!t->ut_stack) {
+		for (j = 0; j < UTHREAD_STACKPAGES; j++)
+			if ((r = sys_page_alloc(0, (void *) (stack + j * PGSIZE),
+						PTE_P|PTE_U|PTE_W)) < 0) {
+				busy = 0;
+				return r;
+			}
+		t->ut_stack = 1;
+	}
+
+	// Make the first uswitch to it "return" into uthread_entry.
+	sp = (uint32_t *) (stack + UTHREAD_STACKPAGES * PGSIZE);
+	*--sp = 0;			// uthread_entry's return address
+	*--sp = (uint32_t) uthread_entry;
+	*--sp = 0;			// %ebp
+	*--sp = 0;			// %ebx
+	*--sp = 0;			// %esi
+	*--sp = 0;			// %edi
+	t->ut_esp = (uint32_t) sp;
+	t->ut_fn = fn;
+	t->ut_arg = arg;
+	t->ut_state = UT_READY;
+	enqueue(&runq, t);
+	nthreads++;
+	busy = 0;
+	return i;
+}
+
+// Let the next ready thread run.  Returns 0 at once if there is none,
+// 1 after the others have had their turn.
+int
+uthread_yield(void)
+{
+	struct UThread *t = self();
+
+	if (!runq.head)
+		return 0;
+	busy = 1;
+	t->ut_state = UT_READY;
+	enqueue(&runq, t);
+	reschedule();
+	busy = 0;
+	return 1;
+}
+
+// End the current thread.  The environment exits with its last thread.
+void
+uthread_exit(void)
+{
+	busy = 1;
+	self()->ut_state = UT_FREE;
+	nthreads--;
+	reschedule();
+	panic("uthread_exit: freed thread rescheduled");
+}
+
+// Id of the current thread; the environment's own thread is 0.
+int
+uthread_self(void)
+{
+	return self() - threads;
+}
+
+// Are there threads besides this one?
+bool
+uthread_active(void)
+{
+	return nthreads > 1;
+}
+
+// ipc_recv for when other threads exist: wait without blocking them.
+// The environment only blocks in the kernel once every thread waits.
+int32_t
+uthread_ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	struct UThread *t = self();
+
+	busy = 1;
+	t->ut_ipc_pg = pg;
+	t->ut_state = UT_IPCWAIT;
+	enqueue(&ipcq, t);
+	reschedule();
+	busy = 0;
+
+	if (from_env_store)
+		*from_env_store = t->ut_ipc_from;
+	if (perm_store)
+		*perm_store = t->ut_ipc_perm;
+	return t->ut_ipc_ret;
+}
+
+// Scheduler activation handler, called from _sa_upcall.  On preemption,
+// copy the interrupted thread's state onto its own stack and make the
+// upcall return into _sa_resume there, which saves its FPU state,
+// yields to the next thread and later resumes this one where the timer
+// stopped it.
+void
+_sa_handler(struct UTrapframe *utf)
+{
+	struct UTrapframe *saved;
+
+	if (!(utf->utf_err & SA_PREEMPTED) || busy || !runq.head)
+		return;
+
+	// Leave a word above the copy for _utf_return's scratch use.
+	saved = (struct UTrapframe *) (utf->utf_esp - 4) - 1;
+	*saved = *utf;
+	utf->utf_esp = (uintptr_t) saved;
+	utf->utf_eip = (uintptr_t) _sa_resume;
+}
+
+// Have the kernel's scheduler activations preempt threads.
+int
+uthread_preempt(void)
+{
+	int r;
+
+	if (!(vpd[PDX(UXSTACKBASE)] & PTE_P) || !(vpt[PGNUM(UXSTACKBASE)] & PTE_P))
+		if ((r = sys_page_alloc(0, (void *) UXSTACKBASE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	return sys_env_set_sa_upcall(0, _sa_upcall);
+}
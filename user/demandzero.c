@@ -0,0 +1,48 @@
+// Check demand-zero regions: reserved memory reads as zero, is only
+// mapped when touched, and stays demand-zero in a forked child.
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0x20000000)
+#define SIZE	(64 * 1024 * 1024)
+#define STRIDE	(1024 * 1024)
+
+// Far more bss than the program touches; load_icode reserves it.
+static char bss[4 * 1024 * 1024];
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t who;
+
+	if ((r = sys_region_reserve(0, REGION, SIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if (sys_region_reserve(0, REGION + SIZE - PGSIZE, 2 * PGSIZE,
+			       PTE_P|PTE_U|PTE_W) != -E_INVAL)
+		panic("overlapping region accepted");
+	if (vpd[PDX(REGION)] & PTE_P)
+		panic("region mapped before it was touched");
+
+	for (i = 0; i < SIZE; i += STRIDE) {
+		if (REGION[i] != 0)
+			panic("region byte %x not zero", i);
+		REGION[i] = 1;
+	}
+	if (bss[sizeof(bss) - 1] != 0 || (vpt[PGNUM(&bss[sizeof(bss) / 2])] & PTE_P))
+		panic("bss not demand-zero");
+
+	// Memory handed to the kernel is mapped in on first use as well.
+	sys_cputs(REGION + PGSIZE, 0);
+	if (!(vpt[PGNUM(REGION + PGSIZE)] & PTE_P))
+		panic("sys_cputs did not map its buffer");
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		if (REGION[0] != 1 || REGION[2 * PGSIZE] != 0 || REGION[STRIDE] != 1)
+			panic("child sees the wrong region contents");
+		cprintf("demandzero OK\n");
+		return;
+	}
+}
@@ -0,0 +1,89 @@
+// Check the EDF class: a periodic job with a reservation meets every
+// deadline while spinning environments, as in user/spin.c, keep all
+// CPUs busy, and a reservation no CPU can honor is refused.  Then check
+// that a message wakes the job up at once, ahead of the spinners, even
+// when they have the longest timeslices there are.
+
+#include <inc/lib.h>
+
+#define NSPIN		8
+#define PERIOD_US	50000
+#define BUDGET_US	10000
+#define WORK_US		2000
+#define NPERIOD		20
+#define NMSG		10
+#define SPIN_QUANTUM_US	1000000
+#define MSG_LATENCY_US	10000
+
+static uint32_t
+now_us(void)
+{
+	return sys_time_ns() / 1000;
+}
+
+// Keep sending the parent the time of each try, in microseconds.
+static void
+sender(envid_t parent)
+{
+	int r;
+
+	for (;;)
+		if ((r = sys_ipc_try_send(parent, now_us(), 0, 0)) < 0
+		    && r != -E_IPC_NOT_RECV)
+			panic("sys_ipc_try_send: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t spin[NSPIN], snd;
+	uint64_t t0;
+	uint32_t late;
+	int i, r;
+
+	for (i = 0; i < NSPIN; i++) {
+		if ((spin[i] = fork()) < 0)
+			panic("fork: %e", spin[i]);
+		if (spin[i] == 0)
+			while (1)
+				/* do nothing */;
+	}
+
+	if ((r = sys_env_set_rt(0, PERIOD_US, PERIOD_US)) != -E_INVAL)
+		panic("admitted a reservation of a whole CPU: %e", r);
+	if ((r = sys_env_set_rt(0, PERIOD_US, BUDGET_US)) < 0)
+		panic("sys_env_set_rt: %e", r);
+
+	// Start on a period boundary.
+	sys_yield();
+	for (i = 0; i < NPERIOD; i++) {
+		t0 = sys_time_ns();
+		while (sys_time_ns() - t0 < WORK_US * 1000)
+			/* work */;
+		if (sys_time_ns() > thisenv->env_rt_deadline)
+			panic("edf: missed the deadline of period %d", i);
+		sys_yield();
+	}
+	if (thisenv->env_rt_misses)
+		panic("edf: kernel counted %d misses", thisenv->env_rt_misses);
+
+	// Just released, with the budget of this period left: block for
+	// messages from a best-effort sender.
+	if ((snd = fork()) < 0)
+		panic("fork: %e", snd);
+	if (snd == 0)
+		sender(thisenv->env_parent_id);
+	sys_env_set_quantum(snd, SPIN_QUANTUM_US);
+	for (i = 0; i < NSPIN; i++)
+		sys_env_set_quantum(spin[i], SPIN_QUANTUM_US);
+	for (i = 0; i < NMSG; i++) {
+		late = ipc_recv(0, 0, 0);
+		if ((late = now_us() - late) > MSG_LATENCY_US)
+			panic("edf: woke up %u us after message %d", late, i);
+	}
+
+	sys_env_destroy(snd);
+	for (i = 0; i < NSPIN; i++)
+		sys_env_destroy(spin[i]);
+	cprintf("edf OK\n");
+}
@@ -1,6 +1,5 @@
 // Demonstrate lack of fairness in IPC.
-// Start three instances of this program as envs 1, 2, and 3.
-// (user/idle is env 0).
+// Start three instances of this program as envs 0, 1, and 2.
 
 #include <inc/lib.h>
 
@@ -11,15 +10,15 @@ umain(int argc, char **argv)
 
 	id = sys_getenvid();
 
-	if (thisenv == &envs[1]) {
+	if (thisenv == &envs[0]) {
 		while (1) {
 			ipc_recv(&who, 0, 0);
 			cprintf("%x recv from %x\n", id, who);
 		}
 	} else {
-		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
+		cprintf("%x loop sending to %x\n", id, envs[0].env_id);
 		while (1)
-			ipc_send(envs[1].env_id, 0, 0, 0);
+			ipc_send(envs[0].env_id, 0, 0, 0);
 	}
 }
 
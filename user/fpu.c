@@ -0,0 +1,26 @@
+// Check that FPU and SSE registers survive context switches.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+	uint32_t want, x87, sse;
+
+	// Parent and child load different values, then trade the CPU
+	// back and forth.
+	want = fork() ? 0x12345678 : 0x9abcdef0;
+	asm volatile("fildl %0" : : "m" (want));
+	asm volatile("movss %0, %%xmm0" : : "m" (want));
+
+	for (i = 0; i < 100; i++)
+		sys_yield();
+
+	asm volatile("fistpl %0" : "=m" (x87));
+	asm volatile("movss %%xmm0, %0" : "=m" (sse));
+	if (x87 != want || sse != want)
+		panic("FPU state lost: x87 %08x sse %08x, want %08x",
+		      x87, sse, want);
+	cprintf("[%08x] FPU state preserved\n", thisenv->env_id);
+}
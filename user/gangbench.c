@@ -0,0 +1,96 @@
+// Time a barrier-heavy parallel job on a loaded machine, with its
+// workers as a gang and without.  Spin counts how often workers found
+// the barrier closed; gang scheduling should cut it sharply.
+
+#include <inc/lib.h>
+
+#define NWORKER		4
+#define NBUSY		4
+#define NROUND		200
+#define SPINMAX		10000
+
+struct Barrier {
+	volatile uint32_t count;
+	volatile uint32_t generation;
+	volatile uint32_t spins;
+	volatile uint32_t yields;
+};
+
+static struct Barrier *bar = (struct Barrier *) 0x30000000;
+
+static void
+barrier(void)
+{
+	uint32_t gen = bar->generation, spins = 0, n = 0;
+
+	if (__sync_add_and_fetch(&bar->count, 1) == NWORKER) {
+		bar->count = 0;
+		bar->generation++;
+		return;
+	}
+	while (bar->generation == gen) {
+		asm volatile("pause");
+		if (++n == SPINMAX) {
+			// Nobody is coming soon: let someone else run.
+			__sync_add_and_fetch(&bar->yields, 1);
+			sys_yield();
+			n = 0;
+		}
+		spins++;
+	}
+	__sync_add_and_fetch(&bar->spins, spins);
+}
+
+static void
+run(bool gang)
+{
+	envid_t parent = sys_getenvid(), who;
+	uint64_t t0;
+	int i, r;
+
+	memset(bar, 0, sizeof(*bar));
+	if (gang && (r = sys_gang_create()) < 0)
+		panic("sys_gang_create: %e", r);
+	t0 = sys_time_ns();
+	for (i = 0; i < NWORKER; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			for (i = 0; i < NROUND; i++)
+				barrier();
+			ipc_send(parent, 0, 0, 0);
+			exit();
+		}
+	}
+	for (i = 0; i < NWORKER; i++)
+		ipc_recv(&who, 0, 0);
+	cprintf("%s: %u us, %u spins, %u yields\n",
+		gang ? "gang" : "no gang",
+		(uint32_t) ((sys_time_ns() - t0) / 1000),
+		bar->spins, bar->yields);
+	if (gang)
+		sys_gang_join(0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t busy[NBUSY];
+	int i, r;
+
+	if ((r = sys_page_alloc(0, bar, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	// Background load that never yields.
+	for (i = 0; i < NBUSY; i++) {
+		if ((busy[i] = fork()) < 0)
+			panic("fork: %e", busy[i]);
+		if (busy[i] == 0)
+			for (;;)
+				asm volatile("pause");
+	}
+
+	run(0);
+	run(1);
+	for (i = 0; i < NBUSY; i++)
+		sys_env_destroy(busy[i]);
+}
@@ -0,0 +1,78 @@
+// Measure malloc/free throughput and the heap pages it maps.
+
+#include <inc/lib.h>
+
+#define NSLOTS		1024
+#define NOPS		200000
+
+static void *slots[NSLOTS];
+static uint32_t seed = 1;
+
+static uint32_t
+rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+// Heap pages currently mapped.
+static uint32_t
+heap_mapped(void)
+{
+	uintptr_t va, p;
+	uint32_t n = 0;
+
+	for (va = UHEAP; va < UHEAP + UHEAPSIZE; va += PTSIZE) {
+		if (!(vpd[PDX(va)] & PTE_P))
+			continue;
+		for (p = va; p < va + PTSIZE; p += PGSIZE)
+			if (vpt[PGNUM(p)] & PTE_P)
+				n++;
+	}
+	return n;
+}
+
+// Random malloc/free mix over sizes in [min, max).  Returns ops/sec.
+static uint32_t
+run(size_t min, size_t max, int nops, uint32_t *peak)
+{
+	uint64_t t0, ns;
+	uint32_t mapped;
+	int i, s;
+
+	t0 = sys_time_ns();
+	for (i = 0; i < nops; i++) {
+		s = rand() % NSLOTS;
+		if (slots[s]) {
+			free(slots[s]);
+			slots[s] = NULL;
+		} else if (!(slots[s] = malloc(min + rand() % (max - min))))
+			panic("malloc failed");
+		if (i % 4096 == 0 && (mapped = heap_mapped()) > *peak)
+			*peak = mapped;
+	}
+	ns = sys_time_ns() - t0;
+
+	for (s = 0; s < NSLOTS; s++) {
+		free(slots[s]);
+		slots[s] = NULL;
+	}
+	return ns ? (uint64_t) nops * 1000000000 / ns : 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t peak;
+
+	cprintf("%16s %12s %12s\n", "sizes", "ops/s", "peak pages");
+	peak = 0;
+	cprintf("%16s %12u", "16-128", run(16, 128, NOPS, &peak));
+	cprintf(" %12u\n", peak);
+	peak = 0;
+	cprintf("%16s %12u", "16-2048", run(16, 2048, NOPS, &peak));
+	cprintf(" %12u\n", peak);
+	peak = 0;
+	cprintf("%16s %12u", "4096-65536", run(4096, 65536, NOPS / 10, &peak));
+	cprintf(" %12u\n", peak);
+}
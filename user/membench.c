@@ -0,0 +1,50 @@
+// Measure memset and memmove throughput for a range of sizes.
+
+#include <inc/lib.h>
+
+#define MAXSIZE		(64 * 1024)
+#define TOTAL		(4 * 1024 * 1024)	// bytes moved per measurement
+
+static char src[MAXSIZE] __attribute__((aligned(PGSIZE)));
+static char dst[MAXSIZE] __attribute__((aligned(PGSIZE)));
+
+// MB/s for 'bytes' bytes in 'ns' nanoseconds.
+static uint32_t
+mbps(uint64_t bytes, uint64_t ns)
+{
+	return ns ? bytes * 1000 / ns : 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const size_t sizes[] = { 64, 256, 1024, 4096, 16384, MAXSIZE };
+	uint64_t t0, t1, t2;
+	int i, j, iters;
+
+	// Fault everything in first.
+	memset(src, 1, sizeof(src));
+	memset(dst, 0, sizeof(dst));
+
+	cprintf("%8s %14s %14s %14s\n", "size", "memset MB/s", "memmove MB/s",
+		"unaligned MB/s");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		iters = TOTAL / sizes[i];
+
+		t0 = sys_time_ns();
+		for (j = 0; j < iters; j++)
+			memset(dst, j, sizes[i]);
+		t1 = sys_time_ns();
+		for (j = 0; j < iters; j++)
+			memmove(dst, src, sizes[i]);
+		t2 = sys_time_ns();
+		cprintf("%8d %14d %14d", sizes[i], mbps(TOTAL, t1 - t0),
+			mbps(TOTAL, t2 - t1));
+
+		t0 = sys_time_ns();
+		for (j = 0; j < iters; j++)
+			memmove(dst + 1, src, sizes[i] - 1);
+		t1 = sys_time_ns();
+		cprintf(" %14d\n", mbps(TOTAL, t1 - t0));
+	}
+}
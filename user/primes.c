@@ -4,9 +4,9 @@
 // The picture halfway down the page and the text surrounding it
 // explain what's going on here.
 //
-// Since NENVS is 1024, we can print 1022 primes before running out.
-// The remaining two environments are the integer generator at the bottom
-// of main and user/idle.
+// We can print one prime fewer than the kernel has environments (it
+// sizes envs[] from memory at boot) before running out.  The remaining
+// environment is the integer generator at the bottom of main.
 
 #include <inc/lib.h>
 
@@ -0,0 +1,110 @@
+// Check the run queue: a runnable environment never runs while one of a
+// higher priority may run on the same CPU, one taken off the queue
+// with sys_env_set_status stays off it, and nobody may raise itself.
+
+#include <inc/lib.h>
+
+#define PRIO_HIGH	18
+#define PRIO_LOW	20
+#define NWORK		200
+#define WAIT_NS		20000000
+
+struct Shared {
+	volatile uint32_t lcount;	// Bumped by the low child
+	volatile int want;		// Parent waits on a message from it
+};
+
+static struct Shared *shared = (struct Shared *) 0x30000000;
+
+// Lowest priority: count forever, and tell the parent when asked.
+static void
+low(envid_t parent)
+{
+	int r;
+
+	sys_env_set_priority(0, PRIO_LOW);
+	if ((r = sys_env_set_priority(0, PRIO_HIGH)) != -E_INVAL)
+		panic("prio: raised itself above its level: %e", r);
+	for (;;) {
+		shared->lcount++;
+		if (shared->want) {
+			shared->want = 0;
+			ipc_send(parent, 0, 0, 0);
+		}
+	}
+}
+
+// Higher priority: work for a while, yielding now and then, and report
+// whether the low child ran meanwhile.
+static void
+high(envid_t parent)
+{
+	uint32_t n0;
+	uint64_t t0;
+	int i;
+
+	sys_env_set_priority(0, PRIO_HIGH);
+	sys_yield();
+	n0 = shared->lcount;
+	for (i = 0; i < NWORK; i++) {
+		t0 = sys_time_ns();
+		while (sys_time_ns() - t0 < 100000)
+			/* work */;
+		if (i % 10 == 0)
+			sys_yield();
+	}
+	ipc_send(parent, shared->lcount == n0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t lo, hi;
+	uint32_t n0;
+	uint64_t t0;
+	int r;
+
+	// Everything on one CPU, with a page shared across fork.
+	sys_env_set_affinity(0, 1);
+	sys_yield();
+	if ((r = sys_page_alloc(0, shared, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = sys_env_set_priority(0, 0)) != -E_INVAL)
+		panic("prio: raised itself to level 0: %e", r);
+
+	// Wait for the low child to be counting at its level.
+	shared->want = 1;
+	if ((lo = fork()) < 0)
+		panic("fork: %e", lo);
+	if (lo == 0)
+		low(thisenv->env_parent_id);
+	ipc_recv(0, 0, 0);
+
+	if ((hi = fork()) < 0)
+		panic("fork: %e", hi);
+	if (hi == 0) {
+		high(thisenv->env_parent_id);
+		exit();
+	}
+	if (!ipc_recv(0, 0, 0))
+		panic("prio: low priority env ran beside a higher one");
+
+	// Off the run queue, it must not run however long we yield.
+	sys_env_set_status(lo, ENV_NOT_RUNNABLE);
+	n0 = shared->lcount;
+	t0 = sys_time_ns();
+	while (sys_time_ns() - t0 < WAIT_NS)
+		sys_yield();
+	if (shared->lcount != n0)
+		panic("prio: env ran while not runnable");
+
+	// Back on it, it runs once we block.
+	sys_env_set_status(lo, ENV_RUNNABLE);
+	shared->want = 1;
+	ipc_recv(0, 0, 0);
+	if (shared->lcount == n0)
+		panic("prio: env did not run once runnable again");
+
+	sys_env_destroy(lo);
+	cprintf("prio OK\n");
+}
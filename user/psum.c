@@ -0,0 +1,83 @@
+// Sum an array with 1, 2, 4, ... threads (one per CPU) created by
+// sfork, all reading the same malloc'ed memory.
+
+#include <inc/lib.h>
+
+#define N		(1 << 20)
+#define MAXTHREADS	32
+
+static uint32_t *data;
+static volatile uint32_t go, done;
+static volatile uint64_t partial[MAXTHREADS];
+
+static uint64_t
+sum(int i, int nthreads)
+{
+	uint32_t j, end = (uint64_t) N * (i + 1) / nthreads;
+	uint64_t s = 0;
+
+	for (j = (uint64_t) N * i / nthreads; j < end; j++)
+		s += data[j];
+	return s;
+}
+
+static int
+count_cpus(void)
+{
+	int n;
+
+	for (n = 1; n < MAXTHREADS && sys_env_set_affinity(0, 1 << n) == 0; n++)
+		;
+	sys_env_set_affinity(0, ENV_CPUMASK_ALL);
+	return n;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t want = 0, got, t0, t1;
+	int ncpu, nthreads, i;
+	envid_t who;
+
+	ncpu = count_cpus();
+	if (!(data = malloc(N * sizeof(data[0]))))
+		panic("malloc failed");
+	for (i = 0; i < N; i++) {
+		data[i] = i * 2654435761U;
+		want += data[i];
+	}
+
+	for (nthreads = 1; nthreads <= ncpu; nthreads *= 2) {
+		go = done = 0;
+		for (i = 1; i < nthreads; i++) {
+			if ((who = sfork()) < 0)
+				panic("sfork: %e", who);
+			if (who == 0) {
+				sys_env_set_affinity(0, 1 << i);
+				while (!go)
+					asm volatile("pause");
+				partial[i] = sum(i, nthreads);
+				__sync_fetch_and_add(&done, 1);
+				return;
+			}
+		}
+
+		sys_env_set_affinity(0, 1 << 0);
+		t0 = sys_time_ns();
+		go = 1;
+		partial[0] = sum(0, nthreads);
+		while (done != nthreads - 1)
+			sys_yield();
+		t1 = sys_time_ns();
+		sys_env_set_affinity(0, ENV_CPUMASK_ALL);
+
+		for (got = 0, i = 0; i < nthreads; i++)
+			got += partial[i];
+		if (got != want)
+			panic("psum: %d threads got %llx, want %llx",
+			      nthreads, got, want);
+		cprintf("psum: %d threads %u us\n", nthreads,
+			(uint32_t) ((t1 - t0) / 1000));
+	}
+	cprintf("psum OK\n");
+}
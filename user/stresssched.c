@@ -5,8 +5,9 @@ volatile int counter;
 void
 umain(int argc, char **argv)
 {
-	int i, j;
+	int i, j, r;
 	int seen;
+	uint32_t cpumask = ENV_CPUMASK_ALL;
 	envid_t parent = sys_getenvid();
 
 	// Fork several environments
@@ -18,13 +19,24 @@ umain(int argc, char **argv)
 		return;
 	}
 
+	// Pin every other environment to CPU 0
+	if (i % 2 == 0) {
+		cpumask = 1 << 0;
+		if ((r = sys_env_set_affinity(0, cpumask)) < 0)
+			panic("sys_env_set_affinity: %e", r);
+	}
+
 	// Wait for the parent to finish forking
-	while (envs[ENVX(parent)].env_status != ENV_FREE)
+	while (envs[ENVX(parent)].env_status != ENV_FREE
+	       && envs[ENVX(parent)].env_status != ENV_RECLAIM)
 		asm volatile("pause");
 
 	// Check that one environment doesn't run on two CPUs at once
 	for (i = 0; i < 10; i++) {
 		sys_yield();
+		if (!(cpumask & (1 << thisenv->env_cpunum)))
+			panic("ran on CPU %d outside its affinity mask",
+			      thisenv->env_cpunum);
 		for (j = 0; j < 10000; j++)
 			counter++;
 	}
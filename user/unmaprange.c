@@ -0,0 +1,47 @@
+// Check sys_page_unmap_range across a page table boundary.
+
+#include <inc/lib.h>
+
+#define BASE	((char *) (0x10000000 - 4 * PGSIZE))
+#define NPAGES	8
+
+static bool
+mapped(int i)
+{
+	uintptr_t va = (uintptr_t) (BASE + i * PGSIZE);
+
+	return (vpd[PDX(va)] & PTE_P) && (vpt[PGNUM(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, BASE + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	if (sys_page_unmap_range(0, BASE + 1, PGSIZE) != -E_INVAL
+	    || sys_page_unmap_range(0, BASE, PGSIZE + 1) != -E_INVAL
+	    || sys_page_unmap_range(0, (void *) (UTOP - PGSIZE),
+				    2 * PGSIZE) != -E_INVAL)
+		panic("bad range accepted");
+
+	// The middle four pages, two on each side of the boundary.
+	if ((r = sys_page_unmap_range(0, BASE + 2 * PGSIZE, 4 * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if (mapped(i) != (i < 2 || i >= 6))
+			panic("unmaprange: page %d wrongly %s", i,
+			      mapped(i) ? "mapped" : "unmapped");
+
+	// Everything else; both page tables are left empty and freed.
+	if ((r = sys_page_unmap_range(0, BASE, NPAGES * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	if ((vpd[PDX(BASE)] & PTE_P) || (vpd[PDX(BASE + 4 * PGSIZE)] & PTE_P))
+		panic("unmaprange: page table not freed");
+
+	cprintf("unmaprange OK\n");
+}
@@ -0,0 +1,52 @@
+// Compare a switch between user-level threads with a switch between
+// environments through the kernel.
+
+#include <inc/lib.h>
+
+#define NSWITCH		100000
+
+static void
+yielder(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NSWITCH; i++)
+		uthread_yield();
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t t0, uthread_ns, env_ns;
+	envid_t child;
+	int i;
+
+	// Two threads taking turns: 2 * NSWITCH switches.
+	if (uthread_create(yielder, 0) < 0)
+		panic("uthread_create failed");
+	t0 = sys_time_ns();
+	for (i = 0; i < NSWITCH; i++)
+		uthread_yield();
+	uthread_ns = (sys_time_ns() - t0) / (2 * NSWITCH);
+	while (uthread_yield())
+		;
+
+	// Two environments on one CPU taking turns through sys_yield.
+	sys_env_set_affinity(0, 1);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (;;)
+			sys_yield();
+	}
+	sys_yield();
+	t0 = sys_time_ns();
+	for (i = 0; i < NSWITCH / 10; i++)
+		sys_yield();
+	env_ns = (sys_time_ns() - t0) / (2 * (NSWITCH / 10));
+	sys_env_destroy(child);
+
+	cprintf("uthread switch %u ns, env switch %u ns, ratio %u\n",
+		(uint32_t) uthread_ns, (uint32_t) env_ns,
+		(uint32_t) (uthread_ns ? env_ns / uthread_ns : 0));
+}
@@ -0,0 +1,36 @@
+// Check preemptive user-level threads: two threads that spin without
+// ever yielding both make progress, because scheduler activations
+// switch between them when the timer preempts the environment.
+
+#include <inc/lib.h>
+
+static volatile int count[2];
+static volatile int done;
+
+static void
+spinner(void *arg)
+{
+	int id = (int) arg;
+
+	// Wait for the sibling to get going; only preemption lets it run.
+	while (!count[!id])
+		count[id]++;
+	while (count[id] < 1000000)
+		count[id]++;
+	done++;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	if ((r = uthread_preempt()) < 0)
+		panic("uthread_preempt: %e", r);
+	for (i = 0; i < 2; i++)
+		if (uthread_create(spinner, (void *) i) < 0)
+			panic("uthread_create failed");
+	while (done < 2)
+		uthread_yield();
+	cprintf("uthreadpreempt OK\n");
+}
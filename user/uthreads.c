@@ -0,0 +1,80 @@
+// Check user-level threads: they interleave on uthread_yield, and a
+// thread waiting in ipc_recv neither holds up its siblings nor is
+// starved by them.
+
+#include <inc/lib.h>
+
+static int turns[3];
+static int order[9], norder;
+static volatile bool got;
+
+static void
+counter(void *arg)
+{
+	int id = (int) arg, i;
+
+	for (i = 0; i < 3; i++) {
+		order[norder++] = id;
+		turns[id]++;
+		uthread_yield();
+	}
+}
+
+static void
+receiver(void *arg)
+{
+	envid_t from;
+	int32_t v;
+
+	v = ipc_recv(&from, 0, 0);
+	if (v != 42)
+		panic("uthreads: got %d from %08x", v, from);
+	got = 1;
+}
+
+// Never waits: only the polling in the thread scheduler can get the
+// message to the receiver.
+static void
+spinner(void *arg)
+{
+	uint64_t end = sys_time_ns() + 1000000000ULL;
+	int spins = 0;
+
+	while (!got) {
+		if (sys_time_ns() > end)
+			panic("uthreads: receiver starved by a busy thread");
+		spins++;
+		uthread_yield();
+	}
+	// We kept running while the receiver waited.
+	if (!spins)
+		panic("uthreads: receiver held up its sibling");
+	cprintf("uthreads OK\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid();
+	int i;
+
+	if (fork() == 0) {
+		ipc_send(parent, 42, 0, 0);
+		return;
+	}
+
+	// Round robin: 0 1 2 0 1 2 0 1 2.
+	for (i = 0; i < 3; i++)
+		if (uthread_create(counter, (void *) i) < 0)
+			panic("uthread_create failed");
+	while (uthread_yield())
+		;
+	for (i = 0; i < 9; i++)
+		if (order[i] != i % 3)
+			panic("uthreads: thread %d ran in turn %d", order[i], i);
+
+	if (uthread_create(receiver, 0) < 0
+	    || uthread_create(spinner, 0) < 0)
+		panic("uthread_create failed");
+	uthread_exit();
+}
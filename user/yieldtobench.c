@@ -0,0 +1,71 @@
+// Compare handing the CPU back and forth between two environments with
+// sys_yield and with sys_yield_to, while other environments compete for
+// the same CPU.
+
+#include <inc/lib.h>
+
+#define NROUND		2000
+#define NBUSY		3
+
+static volatile int *turn = (volatile int *) 0x30000000;
+
+// Pass the turn back and forth NROUND times, waiting with sys_yield or
+// with sys_yield_to the partner.
+static void
+play(int me, envid_t partner, bool directed)
+{
+	int i;
+
+	for (i = 0; i < NROUND; i++) {
+		while (*turn != me)
+			if (!directed || sys_yield_to(partner) < 0)
+				sys_yield();
+		*turn = !me;
+	}
+}
+
+static uint64_t
+round_ns(bool directed)
+{
+	envid_t child;
+	uint64_t t0;
+
+	*turn = 0;
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		play(1, thisenv->env_parent_id, directed);
+		exit();
+	}
+	t0 = sys_time_ns();
+	play(0, child, directed);
+	return (sys_time_ns() - t0) / NROUND;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t busy[NBUSY];
+	uint64_t plain_ns, directed_ns;
+	int i, r;
+
+	// Everything on one CPU, with a page shared across fork.
+	sys_env_set_affinity(0, 1);
+	if ((r = sys_page_alloc(0, (void *) turn, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (i = 0; i < NBUSY; i++) {
+		if ((busy[i] = fork()) < 0)
+			panic("fork: %e", busy[i]);
+		if (busy[i] == 0)
+			for (;;)
+				sys_yield();
+	}
+
+	plain_ns = round_ns(0);
+	directed_ns = round_ns(1);
+	for (i = 0; i < NBUSY; i++)
+		sys_env_destroy(busy[i]);
+
+	cprintf("pingpong round trip: sys_yield %u ns, sys_yield_to %u ns\n",
+		(uint32_t) plain_ns, (uint32_t) directed_ns);
+}